@@ -0,0 +1,110 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+/*
+ * Bump allocator owned by a thread, for the scratch memory of the tasks it runs: see
+ * ThreadPool::currentArena(). Allocating only moves a pointer forward, deallocating does
+ * nothing, and the memory is given back all at once by rewinding to a mark taken before. The
+ * chunks are kept from one task to the next, so a thread running similar tasks stops calling
+ * the global allocator. Usable as a std::pmr::memory_resource, by a single thread.
+ */
+class TaskArena : public std::pmr::memory_resource {
+public:
+    static constexpr size_t FIRST_CHUNK_SIZE = 64 * 1024;
+
+    /* Position of the arena, to rewind to */
+    struct Mark {
+        size_t chunk = 0;
+        size_t offset = 0;
+    };
+
+    TaskArena() = default;
+    TaskArena(const TaskArena &) = delete;
+    TaskArena &operator=(const TaskArena &) = delete;
+
+    Mark mark() const {
+        return {current, offset};
+    }
+
+    /*
+     * Give back everything allocated since the mark. Rewinding the whole arena also merges
+     * its chunks into a single one of their total size, so that the next tasks bump in one
+     * contiguous block.
+     */
+    void rewind(Mark to) {
+        current = to.chunk;
+        offset = to.offset;
+        if (current == 0 && offset == 0 && chunks.size() > 1) {
+            size_t total = 0;
+            for (const Chunk &chunk : chunks) total += chunk.size;
+            chunks.clear();
+            chunks.push_back(Chunk{std::make_unique<std::byte[]>(total), total});
+        }
+    }
+
+    void reset() {
+        rewind(Mark{});
+    }
+
+    /* Bytes reserved by the chunks of the arena */
+    size_t capacity() const {
+        size_t total = 0;
+        for (const Chunk &chunk : chunks) total += chunk.size;
+        return total;
+    }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        if (void *result = bumpIn(current, bytes, alignment)) return result;
+
+        // Continue in a following chunk big enough, or in a new one
+        for (size_t next = current + 1; next < chunks.size(); ++next) {
+            offset = 0;
+            if (void *result = bumpIn(next, bytes, alignment)) {
+                current = next;
+                return result;
+            }
+        }
+        size_t size = std::max({chunks.empty() ? FIRST_CHUNK_SIZE : 2 * chunks.back().size, bytes + alignment});
+        chunks.push_back(Chunk{std::make_unique<std::byte[]>(size), size});
+        current = chunks.size() - 1;
+        offset = 0;
+        return bumpIn(current, bytes, alignment);
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<std::byte[]> memory;
+        size_t size;
+    };
+
+    /* Allocate in the given chunk from offset, or return nullptr if it does not fit */
+    void *bumpIn(size_t chunk, size_t bytes, size_t alignment) {
+        if (chunk >= chunks.size()) return nullptr;
+        uintptr_t base = reinterpret_cast<uintptr_t>(chunks[chunk].memory.get());
+        uintptr_t aligned = (base + offset + alignment - 1) & ~(uintptr_t(alignment) - 1);
+        if (aligned + bytes > base + chunks[chunk].size) return nullptr;
+        offset = aligned + bytes - base;
+        return reinterpret_cast<void *>(aligned);
+    }
+
+    std::vector<Chunk> chunks{};
+    size_t current = 0;
+    size_t offset = 0;
+};
+
+#endif // ARENA_H
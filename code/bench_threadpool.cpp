@@ -0,0 +1,243 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "threadpool.h"
+
+///
+/// \brief waitUntilZero Spin (yielding) until every task of a round has run
+///
+static void waitUntilZero(const std::atomic<int> &remaining)
+{
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        std::this_thread::yield();
+    }
+}
+
+///
+/// \brief A Runnable doing nothing but decrementing a counter, to measure the cost of start()
+///
+class EmptyRunnable : public Runnable
+{
+    std::atomic<int> *m_remaining;
+
+public:
+    explicit EmptyRunnable(std::atomic<int> *remaining) : m_remaining(remaining) {}
+
+    void run() override {
+        m_remaining->fetch_sub(1, std::memory_order_release);
+    }
+
+    void cancelRun() override {
+        m_remaining->fetch_sub(1, std::memory_order_release);
+    }
+
+    std::string id() override {
+        return "Empty";
+    }
+};
+
+///
+/// \brief Throughput of empty callables versus the number of threads of the pool
+/// Each iteration submits a round of 1000 callables and waits for all of them.
+///
+static void BM_EmptyTaskThroughput(benchmark::State &state)
+{
+    const int nbTasks = 1000;
+    ThreadPool pool(state.range(0), nbTasks, std::chrono::milliseconds{1000});
+    std::atomic<int> remaining{0};
+
+    for (auto _ : state) {
+        remaining = nbTasks;
+        for (int i = 0; i < nbTasks; i++) {
+            pool.submit([&remaining]() { remaining.fetch_sub(1, std::memory_order_release); });
+        }
+        waitUntilZero(remaining);
+    }
+
+    state.SetItemsProcessed(state.iterations() * nbTasks);
+}
+BENCHMARK(BM_EmptyTaskThroughput)->RangeMultiplier(2)->Range(1, 32)->UseRealTime();
+
+///
+/// \brief Same as BM_EmptyTaskThroughput with Runnables started through the blocking start()
+///
+static void BM_EmptyRunnableStart(benchmark::State &state)
+{
+    const int nbTasks = 1000;
+    ThreadPool pool(state.range(0), nbTasks, std::chrono::milliseconds{1000});
+    std::atomic<int> remaining{0};
+
+    for (auto _ : state) {
+        remaining = nbTasks;
+        for (int i = 0; i < nbTasks; i++) {
+            pool.start(std::make_unique<EmptyRunnable>(&remaining));
+        }
+        waitUntilZero(remaining);
+    }
+
+    state.SetItemsProcessed(state.iterations() * nbTasks);
+}
+BENCHMARK(BM_EmptyRunnableStart)->RangeMultiplier(2)->Range(1, 32)->UseRealTime();
+
+///
+/// \brief Submit-to-start latency percentiles, from the wait time histogram of the pool
+/// Tasks are submitted one at a time to an idle pool, so the latency includes the wake up.
+///
+static void BM_SubmitToStartLatency(benchmark::State &state)
+{
+    ThreadPool pool(state.range(0), 16, std::chrono::milliseconds{1000});
+    std::atomic<int> remaining{0};
+
+    for (auto _ : state) {
+        remaining = 1;
+        pool.submit([&remaining]() { remaining.fetch_sub(1, std::memory_order_release); });
+        waitUntilZero(remaining);
+    }
+
+    ThreadPoolStats stats = pool.stats();
+    state.counters["p50_ns"] = static_cast<double>(stats.waitTime.percentile(50).count());
+    state.counters["p99_ns"] = static_cast<double>(stats.waitTime.percentile(99).count());
+    state.counters["p999_ns"] = static_cast<double>(stats.waitTime.percentile(99.9).count());
+}
+BENCHMARK(BM_SubmitToStartLatency)->Arg(1)->Arg(4)->Arg(16)->UseRealTime();
+
+///
+/// \brief Bursty producer: bursts of tasks of a few microseconds separated by pauses
+/// The pauses let the threads go idle, so each burst pays the wake up of the pool.
+///
+static void BM_BurstyProducer(benchmark::State &state)
+{
+    const int burstSize = state.range(0);
+    ThreadPool pool(8, burstSize, std::chrono::milliseconds{1000});
+    std::atomic<int> remaining{0};
+
+    for (auto _ : state) {
+        remaining = burstSize;
+        for (int i = 0; i < burstSize; i++) {
+            pool.submit([&remaining]() {
+                auto end = std::chrono::steady_clock::now() + std::chrono::microseconds{2};
+                while (std::chrono::steady_clock::now() < end) {}
+                remaining.fetch_sub(1, std::memory_order_release);
+            });
+        }
+        waitUntilZero(remaining);
+
+        state.PauseTiming();
+        std::this_thread::sleep_for(std::chrono::microseconds{200});
+        state.ResumeTiming();
+    }
+
+    state.SetItemsProcessed(state.iterations() * burstSize);
+}
+BENCHMARK(BM_BurstyProducer)->Arg(16)->Arg(256)->UseRealTime();
+
+///
+/// \brief Many producers starting Runnables on a shared pool, as in testCase4
+/// The queue is small so that part of the Runnables is rejected, which is counted.
+///
+static ThreadPool *sharedPool = nullptr;
+static std::atomic<int> sharedRemaining{0};
+
+static void BM_ManyProducers(benchmark::State &state)
+{
+    if (state.thread_index() == 0) {
+        sharedPool = new ThreadPool(10, 5, std::chrono::milliseconds{1000});
+    }
+
+    const int nbTasks = 100;
+    int64_t nbRejected = 0;
+    for (auto _ : state) {
+        std::atomic<int> remaining{nbTasks};
+        for (int i = 0; i < nbTasks; i++) {
+            if (!sharedPool->start(std::make_unique<EmptyRunnable>(&remaining))) nbRejected++;
+        }
+        waitUntilZero(remaining);
+    }
+
+    state.SetItemsProcessed(state.iterations() * nbTasks);
+    state.counters["rejected"] = benchmark::Counter(static_cast<double>(nbRejected), benchmark::Counter::kAvgIterations);
+
+    if (state.thread_index() == 0) {
+        delete sharedPool;
+        sharedPool = nullptr;
+    }
+}
+BENCHMARK(BM_ManyProducers)->ThreadRange(1, 32)->UseRealTime();
+
+///
+/// \brief Idle timeout churn, as in testCase5
+/// Between two rounds every thread times out, so each round creates its threads again.
+///
+static void BM_IdleTimeoutChurn(benchmark::State &state)
+{
+    const int nbThreads = state.range(0);
+    ThreadPool pool(nbThreads, nbThreads, std::chrono::milliseconds{1});
+    std::atomic<int> remaining{0};
+
+    for (auto _ : state) {
+        remaining = nbThreads;
+        for (int i = 0; i < nbThreads; i++) {
+            pool.submit([&remaining]() { remaining.fetch_sub(1, std::memory_order_release); });
+        }
+        waitUntilZero(remaining);
+
+        // Bounded, so that threads which never time out fail the benchmark instead of hanging the binary
+        state.PauseTiming();
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{1};
+        while (pool.currentNbThreads() > 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
+        state.ResumeTiming();
+        if (pool.currentNbThreads() > 0) {
+            state.SkipWithError("threads still alive one second after their idle timeout");
+            break;
+        }
+    }
+
+    ThreadPoolStats stats = pool.stats();
+    state.counters["threads_created"] = benchmark::Counter(static_cast<double>(stats.threadsCreated), benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_IdleTimeoutChurn)->Arg(1)->Arg(10)->UseRealTime();
+
+///
+/// \brief Throughput of empty callables while other threads read stats() in a loop
+/// Each task updates the WorkerCounters in the record of its thread, which the readers walk
+/// without lock. The records keep the counters on lines of their own, so the readers only
+/// pull these lines: the gap with the run without readers measures that coherence traffic.
+///
+static void BM_SubmitWithStatsReaders(benchmark::State &state)
+{
+    const int nbTasks = 1000;
+    ThreadPool pool(state.range(0), nbTasks, std::chrono::milliseconds{1000});
+    std::atomic<int> remaining{0};
+    std::atomic<bool> stop{false};
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < state.range(1); i++) {
+        readers.emplace_back([&pool, &stop]() {
+            while (!stop.load(std::memory_order_relaxed)) {
+                benchmark::DoNotOptimize(pool.stats().tasksExecuted);
+            }
+        });
+    }
+
+    for (auto _ : state) {
+        remaining = nbTasks;
+        for (int i = 0; i < nbTasks; i++) {
+            pool.submit([&remaining]() { remaining.fetch_sub(1, std::memory_order_release); });
+        }
+        waitUntilZero(remaining);
+    }
+
+    stop = true;
+    for (auto &reader : readers) reader.join();
+    state.SetItemsProcessed(state.iterations() * nbTasks);
+}
+BENCHMARK(BM_SubmitWithStatsReaders)->Args({4, 0})->Args({4, 1})->Args({4, 4})->Args({16, 0})->Args({16, 4})->UseRealTime();
+
+BENCHMARK_MAIN();
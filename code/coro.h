@@ -0,0 +1,347 @@
+#ifndef CORO_H
+#define CORO_H
+
+#if __cplusplus < 202002L
+#error "coro.h requires C++20, see the PCO_COROUTINES option of CMakeLists.txt"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+#include <pcosynchro/pcomutex.h>
+#include <pcosynchro/pcoconditionvariable.h>
+
+#include "threadpool.h"
+
+/*
+ * Coroutines on top of a ThreadPool. A coroutine returning coro::task<T> starts when it is
+ * awaited, and awaiting it suspends the awaiting coroutine instead of blocking its thread: it
+ * is resumed by the thread completing the task. co_await pool.schedule() moves a coroutine to a
+ * thread of the pool, so many logically concurrent tasks only occupy a thread while they run.
+ *
+ * The continuations are chained by symmetric transfer, so long chains of tasks completing
+ * synchronously do not grow the stack. syncWait() is the bridge from ordinary code, the only
+ * place where a thread blocks.
+ */
+namespace coro {
+
+template<typename T = void>
+class task;
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation{};
+    std::exception_ptr error{};
+
+    struct FinalAwaiter {
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() const noexcept {
+        return {};
+    }
+
+    void unhandled_exception() noexcept {
+        error = std::current_exception();
+    }
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value{};
+
+    task<T> get_return_object() noexcept;
+
+    template<typename U>
+    void return_value(U &&result) {
+        value.emplace(std::forward<U>(result));
+    }
+
+    T result() {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    task<void> get_return_object() noexcept;
+
+    void return_void() const noexcept {}
+
+    void result() {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+/* Fire and forget coroutine, started at once and destroying itself at its end */
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() const noexcept {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() const noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() const noexcept {
+            return {};
+        }
+
+        void return_void() const noexcept {}
+
+        void unhandled_exception() const noexcept {
+            std::terminate();
+        }
+    };
+};
+
+} // namespace detail
+
+/* Lazily started coroutine producing a T, awaited by one coroutine or by syncWait() */
+template<typename T>
+class task {
+public:
+    using promise_type = detail::Promise<T>;
+    using value_type = T;
+
+    task() = default;
+
+    explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    task(task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+    task &operator=(task &&other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task() {
+        if (handle) handle.destroy();
+    }
+
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept {
+                return !handle || handle.done();
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                // Start the task, which resumes the awaiting coroutine at its end
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+
+            T await_resume() {
+                return handle.promise().result();
+            }
+        };
+        return Awaiter{handle};
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle{};
+};
+
+template<typename T>
+task<T> detail::Promise<T>::get_return_object() noexcept {
+    return task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::Promise<void>::get_return_object() noexcept {
+    return task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+namespace detail {
+
+template<typename T>
+using Stored = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+template<typename T>
+using WhenAllResult = std::conditional_t<std::is_void_v<T>, void, std::vector<T>>;
+
+template<typename T>
+using WhenAnyResult = std::conditional_t<std::is_void_v<T>, size_t, std::pair<size_t, T>>;
+
+/* Run a task and store its result or exception, then call done() */
+template<typename T, typename Done>
+Detached runAndNotify(task<T> work, std::optional<Stored<T>> &value, std::exception_ptr &error, Done done) {
+    try {
+        if constexpr (std::is_void_v<T>) {
+            co_await std::move(work);
+            value.emplace();
+        } else {
+            value.emplace(co_await std::move(work));
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    done();
+}
+
+struct WhenAllState {
+    // One more than the tasks, for the awaiting coroutine being suspended
+    std::atomic<size_t> remaining{0};
+    std::coroutine_handle<> awaiting{};
+};
+
+template<typename T>
+struct WhenAnyState {
+    std::atomic<bool> won{false};
+    // The first task to complete and the awaiting coroutine being suspended
+    std::atomic<int> gate{2};
+    std::coroutine_handle<> awaiting{};
+    size_t index = 0;
+    std::vector<std::optional<Stored<T>>> values{};
+    std::vector<std::exception_ptr> errors{};
+};
+
+} // namespace detail
+
+/* Awaits all the tasks, run concurrently, and returns their results in order. Rethrows the first exception. */
+template<typename T>
+task<detail::WhenAllResult<T>> whenAll(std::vector<task<T>> tasks) {
+    detail::WhenAllState state;
+    std::vector<std::optional<detail::Stored<T>>> values(tasks.size());
+    std::vector<std::exception_ptr> errors(tasks.size());
+
+    struct Awaiter {
+        detail::WhenAllState &state;
+        std::vector<task<T>> &tasks;
+        std::vector<std::optional<detail::Stored<T>>> &values;
+        std::vector<std::exception_ptr> &errors;
+
+        bool await_ready() const noexcept {
+            return tasks.empty();
+        }
+
+        bool await_suspend(std::coroutine_handle<> awaiting) {
+            state.awaiting = awaiting;
+            state.remaining.store(tasks.size() + 1, std::memory_order_relaxed);
+            for (size_t i = 0; i < tasks.size(); ++i) {
+                detail::runAndNotify(std::move(tasks[i]), values[i], errors[i], [this]() {
+                    if (state.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) state.awaiting.resume();
+                });
+            }
+            // Resume at once if every task has already completed
+            return state.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+        }
+
+        void await_resume() const noexcept {}
+    };
+    co_await Awaiter{state, tasks, values, errors};
+
+    for (auto &error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+    if constexpr (!std::is_void_v<T>) {
+        std::vector<T> results;
+        results.reserve(values.size());
+        for (auto &value : values) results.push_back(std::move(*value));
+        co_return results;
+    }
+}
+
+/*
+ * Awaits the first of the tasks to complete and returns its index, with its result if any.
+ * The other tasks go on in the background and their results are dropped.
+ */
+template<typename T>
+task<detail::WhenAnyResult<T>> whenAny(std::vector<task<T>> tasks) {
+    auto state = std::make_shared<detail::WhenAnyState<T>>();
+    state->values.resize(tasks.size());
+    state->errors.resize(tasks.size());
+
+    // Only references to the locals of the coroutine: GCC 12 (seen with 12.2) destroys the
+    // temporary operand of co_await twice, which would release an owned state a second time
+    struct Awaiter {
+        std::shared_ptr<detail::WhenAnyState<T>> &state;
+        std::vector<task<T>> &tasks;
+
+        bool await_ready() const noexcept {
+            return tasks.empty();
+        }
+
+        bool await_suspend(std::coroutine_handle<> awaiting) {
+            state->awaiting = awaiting;
+            for (size_t i = 0; i < tasks.size(); ++i) {
+                // Each task keeps the state alive, since it may end after the awaiting coroutine
+                detail::runAndNotify(std::move(tasks[i]), state->values[i], state->errors[i], [state = state, i]() {
+                    if (state->won.exchange(true, std::memory_order_acq_rel)) return;
+                    state->index = i;
+                    if (state->gate.fetch_sub(1, std::memory_order_acq_rel) == 1) state->awaiting.resume();
+                });
+            }
+            return state->gate.fetch_sub(1, std::memory_order_acq_rel) != 1;
+        }
+
+        void await_resume() const noexcept {}
+    };
+    co_await Awaiter{state, tasks};
+
+    size_t index = state->index;
+    if (state->errors[index]) std::rethrow_exception(state->errors[index]);
+    if constexpr (std::is_void_v<T>) {
+        co_return index;
+    } else {
+        co_return std::make_pair(index, std::move(*state->values[index]));
+    }
+}
+
+/* Block the calling thread, which must not be a thread of the pool, until the task has completed. */
+template<typename T>
+T syncWait(task<T> work) {
+    PcoMutex mutex;
+    PcoConditionVariable condition;
+    bool done = false;
+    std::optional<detail::Stored<T>> value;
+    std::exception_ptr error;
+
+    detail::runAndNotify(std::move(work), value, error, [&]() {
+        mutex.lock();
+        done = true;
+        condition.notifyAll();
+        mutex.unlock();
+    });
+
+    mutex.lock();
+    while (!done) condition.wait(&mutex);
+    mutex.unlock();
+
+    if (error) std::rethrow_exception(error);
+    if constexpr (!std::is_void_v<T>) return std::move(*value);
+}
+
+} // namespace coro
+
+#endif // CORO_H
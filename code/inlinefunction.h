@@ -0,0 +1,108 @@
+#ifndef INLINEFUNCTION_H
+#define INLINEFUNCTION_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Move-only void() callable stored in place, used as the payload of a queued task. Callables
+ * of up to INLINE_SIZE bytes are constructed inside the object itself so that submitting them
+ * does not allocate; bigger ones fall back to the heap.
+ */
+class InlineFunction {
+public:
+    static constexpr size_t INLINE_SIZE = 48;
+
+    InlineFunction() = default;
+
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, InlineFunction>>>
+    InlineFunction(F &&function) {
+        using Stored = std::decay_t<F>;
+        if constexpr (fitsInline<Stored>()) {
+            new (storage) Stored(std::forward<F>(function));
+            ops = &inlineOps<Stored>;
+        } else {
+            *reinterpret_cast<Stored **>(storage) = new Stored(std::forward<F>(function));
+            ops = &heapOps<Stored>;
+        }
+    }
+
+    InlineFunction(InlineFunction &&other) noexcept {
+        moveFrom(other);
+    }
+
+    InlineFunction &operator=(InlineFunction &&other) noexcept {
+        if (this != &other) {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    InlineFunction(const InlineFunction &) = delete;
+    InlineFunction &operator=(const InlineFunction &) = delete;
+
+    ~InlineFunction() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return ops != nullptr;
+    }
+
+    void operator()() {
+        ops->invoke(storage);
+    }
+
+    void reset() {
+        if (ops) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void *storage);
+        // Move constructs the callable of from into to, and destroys the one of from
+        void (*relocate)(void *from, void *to);
+        void (*destroy)(void *storage);
+    };
+
+    template<typename F>
+    static constexpr bool fitsInline() {
+        return sizeof(F) <= INLINE_SIZE && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<F>;
+    }
+
+    template<typename F>
+    static inline const Ops inlineOps = {
+        [](void *storage) { (*static_cast<F *>(storage))(); },
+        [](void *from, void *to) {
+            new (to) F(std::move(*static_cast<F *>(from)));
+            static_cast<F *>(from)->~F();
+        },
+        [](void *storage) { static_cast<F *>(storage)->~F(); },
+    };
+
+    template<typename F>
+    static inline const Ops heapOps = {
+        [](void *storage) { (**static_cast<F **>(storage))(); },
+        [](void *from, void *to) { *static_cast<F **>(to) = *static_cast<F **>(from); },
+        [](void *storage) { delete *static_cast<F **>(storage); },
+    };
+
+    void moveFrom(InlineFunction &other) {
+        ops = other.ops;
+        if (ops) {
+            ops->relocate(other.storage, storage);
+            other.ops = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+    const Ops *ops = nullptr;
+};
+
+#endif // INLINEFUNCTION_H
@@ -0,0 +1,106 @@
+#ifndef MPMCQUEUE_H
+#define MPMCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/*
+ * Bounded lock-free multi-producer multi-consumer queue (D. Vyukov). Each cell carries a
+ * sequence number telling whether it is free for the producer at a given position or holds
+ * the item for the consumer at that position, so producers and consumers only contend on
+ * their own position counter. The capacity does not need to be a power of two. A queue of
+ * capacity 1 still has two cells: with a single one, the sequence of the full cell would be the
+ * one of the free cell of the next position, and a second push would overwrite the item.
+ */
+template<typename T>
+class BoundedMpmcQueue {
+public:
+    explicit BoundedMpmcQueue(size_t capacity)
+        : capacity(capacity), nbCells(capacity == 1 ? 2 : capacity), cells(new Cell[nbCells]) {
+        for (size_t i = 0; i < nbCells; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    BoundedMpmcQueue(const BoundedMpmcQueue &) = delete;
+    BoundedMpmcQueue &operator=(const BoundedMpmcQueue &) = delete;
+
+    /* Moves item into the queue and returns true, or leaves it untouched and returns false if the queue is full. */
+    bool tryPush(T &item) {
+        if (capacity == 0) return false;
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos % nbCells];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                // Only bounds the spare cell of a queue of capacity 1, the sequences bound the others
+                if (nbCells != capacity && pos - dequeuePos.load(std::memory_order_acquire) >= capacity) return false;
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = std::move(item);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /* Moves the oldest item into item and returns true, or returns false if the queue is empty. */
+    bool tryPop(T &item) {
+        if (capacity == 0) return false;
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos % nbCells];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item = std::move(cell.data);
+                    cell.sequence.store(pos + nbCells, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /* Number of items, only exact when no push or pop is in progress. */
+    size_t size() const {
+        size_t head = dequeuePos.load(std::memory_order_relaxed);
+        size_t tail = enqueuePos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    bool full() const {
+        return size() >= capacity;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence{0};
+        T data{};
+    };
+
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+
+    const size_t capacity;
+    const size_t nbCells;
+    std::unique_ptr<Cell[]> cells;
+    // Producers and consumers positions on their own cache lines
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> enqueuePos{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> dequeuePos{0};
+};
+
+#endif // MPMCQUEUE_H
@@ -0,0 +1,162 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "threadpool.h"
+
+/*
+ * Data-parallel algorithms on top of a ThreadPool. A range is split recursively in two: the
+ * second half is submitted to the pool and the first one is processed by the current thread,
+ * down to ranges of grain elements. A thread waiting for the half it submitted runs the
+ * pending tasks of the pool meanwhile, so neither the caller nor a pool thread sits idle,
+ * and nested calls cannot deadlock. The submitted callables only hold a reference to the half
+ * they run, so they are stored inline in the queue without any allocation per chunk.
+ *
+ * An exception thrown by the function of a chunk is rethrown by the algorithm, once every half
+ * submitted so far has completed: none of them can still refer to the stack of the caller.
+ * The chunks not yet started may then be skipped, so the range is partially processed.
+ *
+ * A grain of 0 selects it from the size of the range: about 8 chunks per thread of the pool,
+ * enough to balance the load without paying the split for tiny chunks. If the queue of the
+ * pool is full, the half which could not be submitted is processed by the current thread.
+ */
+namespace parallel {
+
+namespace detail {
+
+inline size_t chooseGrain(ThreadPool &pool, size_t size, size_t grain) {
+    if (grain > 0) return grain;
+    size_t nbChunks = 8 * static_cast<size_t>(std::max(pool.maxNbThreads(), 1));
+    return std::max<size_t>(1, size / nbChunks);
+}
+
+/* Wait for a task while running the pending tasks of the pool */
+inline void helpUntilDone(ThreadPool &pool, TaskHandle &handle) {
+    while (!handle.isDone()) {
+        if (!pool.runPendingTask()) std::this_thread::yield();
+    }
+}
+
+/*
+ * Call second on the pool and first in the current thread, and return once both are done.
+ * second is called here too if the pool cancelled it. The exception of first, or else the
+ * one of second, is rethrown only after second has completed.
+ */
+template<typename First, typename Second>
+void forkJoin(ThreadPool &pool, const First &first, const Second &second) {
+    Future<void> submitted = pool.submit([&second]() { second(); });
+    std::exception_ptr error;
+    try {
+        first();
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    helpUntilDone(pool, submitted);
+    if (error) std::rethrow_exception(error);
+    if (submitted.status() == TaskHandle::Status::Cancelled) second();
+    else submitted.get();
+}
+
+/* Call body(begin, end) on chunks of at most grain elements covering [begin, end[ */
+template<typename Body>
+void splitRange(ThreadPool &pool, size_t begin, size_t end, size_t grain, const Body &body) {
+    if (end - begin <= grain) {
+        body(begin, end);
+        return;
+    }
+
+    size_t middle = begin + (end - begin) / 2;
+    forkJoin(pool, [&]() { splitRange(pool, begin, middle, grain, body); },
+             [&]() { splitRange(pool, middle, end, grain, body); });
+}
+
+/* Holds the parameters of a reduction, so that the submitted halves only capture a reference to it */
+template<typename T, typename Map, typename Combine>
+struct Reduction {
+    ThreadPool &pool;
+    size_t grain;
+    const T &identity;
+    const Map &map;
+    const Combine &combine;
+
+    T reduce(size_t begin, size_t end) const {
+        if (end - begin <= grain) {
+            T result = identity;
+            for (size_t i = begin; i < end; ++i) result = combine(std::move(result), map(i));
+            return result;
+        }
+
+        size_t middle = begin + (end - begin) / 2;
+        T left = identity;
+        T right = identity;
+        forkJoin(pool, [&]() { left = reduce(begin, middle); }, [&]() { right = reduce(middle, end); });
+        return combine(std::move(left), std::move(right));
+    }
+};
+
+/* Sort [first, last[ using buffer, of the same size, as the merge destination */
+template<typename Iterator, typename Buffer, typename Compare>
+void mergeSort(ThreadPool &pool, Iterator first, Iterator last, Buffer buffer, size_t grain, const Compare &compare) {
+    size_t size = static_cast<size_t>(last - first);
+    if (size <= grain) {
+        std::sort(first, last, compare);
+        return;
+    }
+
+    Iterator middle = first + size / 2;
+    Buffer bufferMiddle = buffer + size / 2;
+    forkJoin(pool, [&]() { mergeSort(pool, first, middle, buffer, grain, compare); },
+             [&]() { mergeSort(pool, middle, last, bufferMiddle, grain, compare); });
+
+    std::merge(std::make_move_iterator(first), std::make_move_iterator(middle),
+               std::make_move_iterator(middle), std::make_move_iterator(last), buffer, compare);
+    std::move(buffer, buffer + size, first);
+}
+
+} // namespace detail
+
+/* Call function(i) for every i in [begin, end[, in parallel on the pool and the calling thread. */
+template<typename Function>
+void parallel_for(ThreadPool &pool, size_t begin, size_t end, size_t grain, const Function &function) {
+    if (begin >= end) return;
+    auto body = [&function](size_t chunkBegin, size_t chunkEnd) {
+        for (size_t i = chunkBegin; i < chunkEnd; ++i) function(i);
+    };
+    detail::splitRange(pool, begin, end, detail::chooseGrain(pool, end - begin, grain), body);
+}
+
+/*
+ * Returns the combination of map(i) for every i in [begin, end[, starting from identity.
+ * combine must be associative, and identity neutral for it, since each chunk starts from it.
+ */
+template<typename T, typename Map, typename Combine>
+T parallel_reduce(ThreadPool &pool, size_t begin, size_t end, size_t grain, T identity, const Map &map, const Combine &combine) {
+    if (begin >= end) return identity;
+    detail::Reduction<T, Map, Combine> reduction{pool, detail::chooseGrain(pool, end - begin, grain), identity, map, combine};
+    return reduction.reduce(begin, end);
+}
+
+/*
+ * Merge sort of [first, last[: the chunks of grain elements are sorted with std::sort, then
+ * merged pairwise through a single buffer allocated once for the whole sort. Not stable.
+ */
+template<typename Iterator, typename Compare = std::less<>>
+void parallel_sort(ThreadPool &pool, Iterator first, Iterator last, size_t grain = 0, Compare compare = Compare()) {
+    size_t size = static_cast<size_t>(last - first);
+    if (size < 2) return;
+    std::vector<typename std::iterator_traits<Iterator>::value_type> buffer(size);
+    detail::mergeSort(pool, first, last, buffer.begin(), std::max<size_t>(detail::chooseGrain(pool, size, grain), 2), compare);
+}
+
+} // namespace parallel
+
+#endif // PARALLEL_H
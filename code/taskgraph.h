@@ -0,0 +1,166 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <vector>
+#include <pcosynchro/pcomutex.h>
+#include <pcosynchro/pcoconditionvariable.h>
+
+#include "threadpool.h"
+
+/*
+ * Directed acyclic graph of Runnables run on a ThreadPool. A node is submitted to the pool as
+ * soon as all the nodes it depends on have completed, which is tracked by an atomic counter of
+ * remaining predecessors per node: no pool thread ever blocks waiting for a dependency.
+ *
+ * A node fails if its run() throws. Every node downstream of a failed node is then not run but
+ * cancelled with cancelRun(), once all its predecessors have completed, and so are the nodes
+ * the pool refuses because its queue is full or drops before running them, when it is shut down.
+ * A node completes from the continuation of its task, so that every outcome of the task
+ * releases its successors.
+ *
+ * The graph is built once with addNode()/addEdge() and can then be run any number of times,
+ * one run at a time; a run only resets the counters of the nodes and does not allocate.
+ */
+class TaskGraph {
+public:
+    using NodeId = size_t;
+
+    /* Add a node running the given runnable, and return its id */
+    NodeId addNode(std::unique_ptr<Runnable> runnable) {
+        nodes.push_back(std::make_unique<Node>());
+        nodes.back()->runnable = std::move(runnable);
+        return nodes.size() - 1;
+    }
+
+    /* Declare that node to can only run once node from has completed */
+    void addEdge(NodeId from, NodeId to) {
+        assert(from < nodes.size() && to < nodes.size() && from != to);
+        nodes[from]->successors.push_back(to);
+        nodes[to]->nbPredecessors++;
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    /* Submit the nodes without predecessors to the pool and return without waiting. */
+    void start(ThreadPool &pool) {
+        assert(nbUnfinished.load() == 0 && "A TaskGraph can only run once at a time");
+        this->pool = &pool;
+        failed = false;
+        error = nullptr;
+        finished = nodes.empty();
+
+        // Reset every counter before submitting the first root, which may complete and release nodes at once
+        for (auto &node : nodes) {
+            node->remaining.store(node->nbPredecessors, std::memory_order_relaxed);
+            node->cancelled.store(false, std::memory_order_relaxed);
+            node->runFailed = false;
+        }
+        nbUnfinished.store(nodes.size(), std::memory_order_release);
+
+        for (auto &node : nodes) {
+            if (node->nbPredecessors == 0) schedule(*node);
+        }
+    }
+
+    /* Block the caller until every node has run or been cancelled; returns false if a node failed. */
+    bool wait() {
+        mutex.lock();
+        while (!finished) condition.wait(&mutex);
+        bool succeeded = !failed;
+        mutex.unlock();
+        return succeeded;
+    }
+
+    bool run(ThreadPool &pool) {
+        start(pool);
+        return wait();
+    }
+
+    /* Exception thrown by the first failed node of the last run, if any */
+    std::exception_ptr firstError() const {
+        return error;
+    }
+
+private:
+    struct Node {
+        std::unique_ptr<Runnable> runnable{};
+        std::vector<NodeId> successors{};
+        size_t nbPredecessors = 0;
+        // Predecessors not completed yet in the current run
+        std::atomic<size_t> remaining{0};
+        // Set when a predecessor failed or was cancelled
+        std::atomic<bool> cancelled{false};
+        // Set when run() threw, read by the continuation of the task once it has completed
+        bool runFailed = false;
+    };
+
+    void schedule(Node &node) {
+        if (node.cancelled.load(std::memory_order_acquire)) {
+            node.runnable->cancelRun();
+            complete(node, false);
+            return;
+        }
+
+        // Runs at once if the pool refused the task, or once the pool has run or dropped it
+        pool->submit([this, &node]() { runNode(node); }).then([this, &node](TaskHandle::Status status) {
+            if (status == TaskHandle::Status::Cancelled) {
+                // Refused or dropped by the pool, which only cancels the callable
+                node.runnable->cancelRun();
+                fail(nullptr);
+                complete(node, false);
+                return;
+            }
+            complete(node, status == TaskHandle::Status::Done && !node.runFailed);
+        });
+    }
+
+    void runNode(Node &node) {
+        try {
+            node.runnable->run();
+        } catch (...) {
+            fail(std::current_exception());
+            node.runFailed = true;
+        }
+    }
+
+    void fail(std::exception_ptr exception) {
+        mutex.lock();
+        if (!error && exception) error = exception;
+        failed = true;
+        mutex.unlock();
+    }
+
+    void complete(Node &node, bool succeeded) {
+        for (NodeId id : node.successors) {
+            Node &successor = *nodes[id];
+            if (!succeeded) successor.cancelled.store(true, std::memory_order_relaxed);
+            if (successor.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) schedule(successor);
+        }
+
+        if (nbUnfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            mutex.lock();
+            finished = true;
+            condition.notifyAll();
+            mutex.unlock();
+        }
+    }
+
+    std::vector<std::unique_ptr<Node>> nodes{};
+    ThreadPool *pool = nullptr;
+    std::atomic<size_t> nbUnfinished{0};
+
+    PcoMutex mutex{};
+    PcoConditionVariable condition{};
+    bool finished = true;
+    bool failed = false;
+    std::exception_ptr error{};
+};
+
+#endif // TASKGRAPH_H
@@ -0,0 +1,378 @@
+#ifndef TASKHANDLE_H
+#define TASKHANDLE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <pcosynchro/pcomutex.h>
+#include <pcosynchro/pcoconditionvariable.h>
+
+class TaskStatePool;
+
+template<typename T>
+class Future;
+
+/*
+ * Completion handle returned by ThreadPool::submit. It is shared between the caller and
+ * the pool thread running the task, and does not go through the pool monitor so that
+ * waiting on a task does not block the other submitters. Its state comes from the
+ * TaskStatePool of the pool and goes back to it when the last handle on it is destroyed.
+ */
+class TaskHandle {
+public:
+    /* Failed: the task threw an exception, see Future::get() */
+    enum class Status { Pending, Done, Cancelled, Failed };
+
+    TaskHandle() = default;
+
+    TaskHandle(const TaskHandle &other) : state(other.state) {
+        if (state) state->references.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    TaskHandle(TaskHandle &&other) noexcept : state(std::exchange(other.state, nullptr)) {}
+
+    TaskHandle &operator=(TaskHandle other) noexcept {
+        std::swap(state, other.state);
+        return *this;
+    }
+
+    ~TaskHandle() {
+        release();
+    }
+
+    /* Block the caller until the task has been run or cancelled, and return its final status. */
+    Status wait() {
+        if (!state) return Status::Cancelled;
+        state->mutex.lock();
+        while (!state->completed) state->condition.wait(&state->mutex);
+        Status result = state->status;
+        state->mutex.unlock();
+        return result;
+    }
+
+    /* Returns the current status of the task without blocking. */
+    Status status() const {
+        if (!state) return Status::Cancelled;
+        state->mutex.lock();
+        Status result = state->status;
+        state->mutex.unlock();
+        return result;
+    }
+
+    bool isDone() const {
+        return status() != Status::Pending;
+    }
+
+    /*
+     * Request the cancellation of the task. If it is still queued, it is dropped with
+     * cancelRun() instead of run and completes as Cancelled; if it is running, it can notice
+     * it through its CancellationToken and return early.
+     */
+    void cancel() {
+        if (state) state->cancelRequested.store(true, std::memory_order_relaxed);
+    }
+
+    bool cancelRequested() const {
+        return state && state->cancelRequested.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * Attach a continuation called with the final status once the task has completed. It runs
+     * on the pool thread that ran the task, or immediately in the caller if the task is
+     * already completed. Only one continuation can be attached. It must not throw: an exception
+     * thrown on the pool thread is dropped, and the status of the task is left unchanged.
+     */
+    void then(std::function<void(Status)> continuation) {
+        if (!state) {
+            continuation(Status::Cancelled);
+            return;
+        }
+        state->mutex.lock();
+        if (state->status == Status::Pending) {
+            state->continuation = std::move(continuation);
+            state->mutex.unlock();
+            return;
+        }
+        Status result = state->status;
+        state->mutex.unlock();
+        continuation(result);
+    }
+
+private:
+    friend class ThreadPool;
+    friend class WorkStealingPool;
+    friend class TaskStatePool;
+    friend class CancellationToken;
+    template<typename T>
+    friend class Future;
+
+    struct State {
+        mutable PcoMutex mutex{};
+        PcoConditionVariable condition{};
+        Status status = Status::Pending;
+        // Set once the continuation, if any, has returned
+        bool completed = false;
+        std::atomic<bool> cancelRequested{false};
+        std::function<void(Status)> continuation{};
+
+        std::atomic<size_t> references{0};
+        // Pool to give the state back to, only set while the state is in use
+        std::shared_ptr<TaskStatePool> home{};
+        State *nextFree = nullptr;
+
+        // Result of a Future, set before the completion: values of up to RESULT_SIZE bytes are
+        // stored in place so that the state stays reusable without allocating
+        static constexpr size_t RESULT_SIZE = 32;
+        std::exception_ptr error{};
+        alignas(std::max_align_t) unsigned char value[RESULT_SIZE];
+        void (*destroyValue)(unsigned char *) = nullptr;
+
+        template<typename T>
+        static constexpr bool storedInline() {
+            return sizeof(T) <= RESULT_SIZE && alignof(T) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<T>;
+        }
+
+        template<typename T, typename U>
+        void setValue(U &&result) {
+            if constexpr (storedInline<T>()) {
+                new (value) T(std::forward<U>(result));
+                destroyValue = [](unsigned char *stored) { std::launder(reinterpret_cast<T *>(stored))->~T(); };
+            } else {
+                *reinterpret_cast<T **>(value) = new T(std::forward<U>(result));
+                destroyValue = [](unsigned char *stored) { delete *reinterpret_cast<T **>(stored); };
+            }
+        }
+
+        template<typename T>
+        T &valueAs() {
+            if constexpr (storedInline<T>()) return *std::launder(reinterpret_cast<T *>(value));
+            else return **reinterpret_cast<T **>(value);
+        }
+
+        void resetResult() {
+            if (destroyValue) destroyValue(value);
+            destroyValue = nullptr;
+            error = nullptr;
+        }
+
+        void complete(Status result) {
+            mutex.lock();
+            status = result;
+            std::function<void(Status)> toRun = std::move(continuation);
+            continuation = nullptr;
+            mutex.unlock();
+
+            // Run the continuation before waking the waiters so that they observe its effects. An
+            // exception it throws is dropped: the task has completed anyway, and the waiters must be woken
+            if (toRun) {
+                try {
+                    toRun(result);
+                } catch (...) {
+                }
+            }
+
+            mutex.lock();
+            completed = true;
+            condition.notifyAll();
+            mutex.unlock();
+        }
+    };
+
+    /* Takes over a reference on state */
+    explicit TaskHandle(State *state) : state(state) {}
+
+    void complete(Status result) {
+        if (state) state->complete(result);
+    }
+
+    void fail(std::exception_ptr exception) {
+        if (!state) return;
+        state->error = std::move(exception);
+        state->complete(Status::Failed);
+    }
+
+    inline void release();
+
+    State *state = nullptr;
+};
+
+/*
+ * View of the cancellation of the task running on a pool thread, see
+ * ThreadPool::currentCancellationToken(). It is cancelled once the handle of the task has been
+ * cancelled or the deadline of the task has passed, and is only valid during the run of the task.
+ */
+class CancellationToken {
+public:
+    CancellationToken() = default;
+
+    CancellationToken(const TaskHandle &handle, std::chrono::steady_clock::time_point deadline)
+        : state(handle.state), deadline(deadline) {}
+
+    bool isCancelled() const {
+        if (state && state->cancelRequested.load(std::memory_order_relaxed)) return true;
+        return deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline;
+    }
+
+    std::chrono::steady_clock::time_point expiresAt() const {
+        return deadline;
+    }
+
+private:
+    const TaskHandle::State *state = nullptr;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
+/*
+ * Free list of TaskHandle states, so that the steady-state submit/complete path reuses
+ * states instead of allocating one per task. A state in use keeps its pool alive, so handles
+ * may outlive the ThreadPool that created them.
+ */
+class TaskStatePool : public std::enable_shared_from_this<TaskStatePool> {
+public:
+    ~TaskStatePool() {
+        while (freeStates) {
+            TaskHandle::State *state = freeStates;
+            freeStates = state->nextFree;
+            delete state;
+        }
+    }
+
+    /* Returns a handle on a Pending state */
+    TaskHandle acquire() {
+        mutex.lock();
+        TaskHandle::State *state = freeStates;
+        if (state) freeStates = state->nextFree;
+        mutex.unlock();
+
+        if (!state) state = new TaskHandle::State();
+        state->status = TaskHandle::Status::Pending;
+        state->completed = false;
+        state->cancelRequested.store(false, std::memory_order_relaxed);
+        state->nextFree = nullptr;
+        state->references.store(1, std::memory_order_relaxed);
+        state->home = shared_from_this();
+        return TaskHandle(state);
+    }
+
+private:
+    friend class TaskHandle;
+
+    void recycle(TaskHandle::State *state) {
+        mutex.lock();
+        state->nextFree = freeStates;
+        freeStates = state;
+        mutex.unlock();
+    }
+
+    PcoMutex mutex{};
+    TaskHandle::State *freeStates = nullptr;
+};
+
+inline void TaskHandle::release() {
+    if (state && state->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        state->resetResult();
+        // Keep the pool alive while giving the state back to it
+        std::shared_ptr<TaskStatePool> home = std::move(state->home);
+        home->recycle(state);
+    }
+    state = nullptr;
+}
+
+/* Thrown by Future::get() when the task was cancelled instead of run */
+class TaskCancelled : public std::runtime_error {
+public:
+    TaskCancelled() : std::runtime_error("task cancelled") {}
+};
+
+/*
+ * TaskHandle of a callable returning a T, returned by ThreadPool::submit(). The result, or the
+ * exception thrown by the callable, is kept in the pooled state of the handle, so that values
+ * of up to TaskHandle::State::RESULT_SIZE bytes are returned without allocating.
+ */
+template<typename T>
+class Future : public TaskHandle {
+public:
+    using value_type = T;
+
+    Future() = default;
+
+    /*
+     * Block the caller until the task has completed and return its result, once: the value
+     * is moved out of the state. Rethrows the exception of the task if it failed, and throws
+     * TaskCancelled if it was cancelled.
+     */
+    T get() {
+        Status result = wait();
+        if (result == Status::Failed) std::rethrow_exception(state->error);
+        if (result == Status::Cancelled) throw TaskCancelled();
+        if constexpr (!std::is_void_v<T>) return std::move(state->template valueAs<T>());
+    }
+
+    /*
+     * Attach a continuation. Called with a Status, it is the continuation of TaskHandle::then().
+     * Otherwise it is called with the result of the task (nothing for a Future<void>), which it
+     * consumes, and a Future of its own result is returned. It runs inline on the pool thread
+     * completing the task, or at once in the caller if the task has already completed, so it
+     * should be cheap; a heavier one can submit its work to the pool. If the task failed or was
+     * cancelled, the continuation is not called and the returned Future fails or is cancelled
+     * the same way. An exception thrown by the continuation fails the returned Future.
+     */
+    template<typename F>
+    auto then(F &&continuation) {
+        if constexpr (std::is_invocable_v<std::decay_t<F> &, Status>) {
+            TaskHandle::then(std::function<void(Status)>(std::forward<F>(continuation)));
+        } else {
+            using R = std::decay_t<typename ResultOf<std::decay_t<F>>::type>;
+            if (!state) return Future<R>();
+            Future<R> next(state->home->acquire());
+
+            // The state is kept alive by the task until it completes, so the raw pointer is safe
+            TaskHandle::then([source = state, next, function = std::decay_t<F>(std::forward<F>(continuation))](Status status) mutable {
+                if (status == Status::Cancelled) {
+                    next.complete(Status::Cancelled);
+                } else if (status == Status::Failed) {
+                    next.fail(source->error);
+                } else {
+                    try {
+                        next.template setResult<R>([&]() -> decltype(auto) {
+                            if constexpr (std::is_void_v<T>) return function();
+                            else return function(std::move(source->template valueAs<T>()));
+                        });
+                        next.complete(Status::Done);
+                    } catch (...) {
+                        next.fail(std::current_exception());
+                    }
+                }
+            });
+            return next;
+        }
+    }
+
+private:
+    friend class ThreadPool;
+    template<typename U>
+    friend class Future;
+
+    // Result of a continuation called with the result of the task, or with nothing for a Future<void>
+    template<typename F>
+    using ResultOf = std::conditional_t<std::is_void_v<T>, std::invoke_result<F &>, std::invoke_result<F &, std::add_rvalue_reference_t<T>>>;
+
+    /* Takes over the handle, which must not have a result yet */
+    explicit Future(TaskHandle handle) : TaskHandle(std::move(handle)) {}
+
+    /* Call the function and store its result, if any */
+    template<typename R, typename Function>
+    void setResult(Function &&function) {
+        if constexpr (std::is_void_v<R>) function();
+        else state->template setValue<R>(function());
+    }
+};
+
+#endif // TASKHANDLE_H
@@ -3,14 +3,35 @@
 
 #include <iostream>
 #include <stack>
+#include <memory>
+#include <array>
+#include <type_traits>
 #include <vector>
 #include <atomic>
 #include <algorithm>
+#include <cstddef>
 #include <chrono>
 #include <cassert>
+#include <thread>
+#include <exception>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <fstream>
 #include <pcosynchro/pcologger.h>
 #include <pcosynchro/pcothread.h>
 #include <pcosynchro/pcohoaremonitor.h>
+#include <pcosynchro/pcomutex.h>
+#include <pcosynchro/pcoconditionvariable.h>
+#include <pcosynchro/pcosemaphore.h>
+
+#include "arena.h"
+#include "inlinefunction.h"
+#include "mpmcqueue.h"
+#include "taskhandle.h"
+#include "threadpoolstats.h"
+#include "topology.h"
+#include "tracing.h"
 
 class Runnable {
 public:
@@ -20,53 +41,102 @@ public:
     virtual std::string id() = 0;
 };
 
-// Utilisé pour transmettre un unique_ptr en argument de la méthode d'un thread car std::move() ne semble pas fonctionner
-class RunnableWrapper {
-    private:
-    std::unique_ptr<Runnable> runnable;
-    public:
-    RunnableWrapper(std::unique_ptr<Runnable> runnable) : runnable(std::move(runnable)) {}
-    RunnableWrapper(RunnableWrapper& other) : runnable(std::move(other.runnable)) {}
-    std::unique_ptr<Runnable> release() {
-        return std::move(runnable);
-    }
-};
-
 class ThreadPool : PcoHoareMonitor {
 public:
+    /*
+     * Scheduling classes of the tasks. The threads take the tasks of the higher classes first,
+     * and each class has its own queue with its own maxNbWaiting limit.
+     */
+    enum class Priority { Realtime, Normal, Background };
+    static constexpr size_t NB_PRIORITIES = 3;
+
     ThreadPool(int maxThreadCount, int maxNbWaiting, std::chrono::milliseconds idleTimeout)
-        : maxThreadCount(maxThreadCount), maxNbWaiting(maxNbWaiting), idleTimeout(idleTimeout) {}
+        : ThreadPool(maxThreadCount, {size_t(maxNbWaiting), size_t(maxNbWaiting), size_t(maxNbWaiting)}, idleTimeout) {}
+
+    /* Same as above with a maxNbWaiting limit per priority class, indexed by Priority. */
+    ThreadPool(int maxThreadCount, const std::array<size_t, NB_PRIORITIES> &maxNbWaiting, std::chrono::milliseconds idleTimeout)
+        : maxThreadCount(maxThreadCount), maxNbWaiting(maxNbWaiting), idleTimeout(idleTimeout),
+          maxThreads(maxThreadCount), targetThreads(maxThreadCount) {
+        for (size_t i = 0; i < NB_PRIORITIES; ++i) {
+            waiting[i] = std::make_unique<BoundedMpmcQueue<Task>>(maxNbWaiting[i]);
+            lastServed[i] = std::chrono::steady_clock::now().time_since_epoch().count();
+        }
+        statePool = std::make_shared<TaskStatePool>();
+        // The slots never move, so that stats() can read them without entering the monitor
+        workerRecords.reset(new Worker[maxThreadCount]);
+        timerThread = new PcoThread(&ThreadPool::handleTimeouts, this);
+    }
 
     ~ThreadPool() {
-        monitorIn();
-        // Wait for all tasks to be processed
-        if (!waiting.empty()) wait(stopCondition);
-        monitorOut();
+        // Wait for all tasks to be processed, unless the pool has already been shut down
+        shutdown(ShutdownMode::Drain);
 
-        for (auto t : threads) {
-            monitorIn();
-            // request stop
-            t.thread->requestStop();
-            // signal on the condition if the thread is blocked on it
-            signal(*t.condition);
-            monitorOut();
+        delete timerThread;
+        for (size_t i = 0; i < nbSlots; ++i) delete workerRecords[i].thread;
+    }
+
+    enum class ShutdownMode { Drain, CancelPending };
+
+    /*
+     * Stop the pool. With Drain, the queued tasks keep being run until the queue is empty or
+     * the deadline has passed; with CancelPending, or once the deadline has passed, the tasks
+     * still queued are not run: the runnables get cancelRun() and are returned to the caller,
+     * the handles of the callables complete as Cancelled, and the callers blocked in start()
+     * are released. Tasks started afterwards are refused. Then the threads are all asked to
+     * stop before being joined, so that stopping takes the time of the longest running task
+     * rather than the sum of them. Only the first call has an effect.
+     */
+    std::vector<std::unique_ptr<Runnable>> shutdown(ShutdownMode mode,
+                                                    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        std::vector<std::unique_ptr<Runnable>> unexecuted;
+        if (shutDown.exchange(true)) return unexecuted;
 
-            // wait for the thread to end
-            t.thread->join();
-            
-            // delete allocated ressources
-            delete t.thread;
-            delete t.condition;
-            delete t.isWaiting;
+        draining = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        monitorIn();
+        while (mode == ShutdownMode::Drain && nbQueued() > 0) {
+            if (deadline == std::chrono::steady_clock::time_point::max()) {
+                wait(stopCondition);
+                continue;
+            }
+            auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) break;
+            monitorOut();
+            PcoThread::usleep(std::min<int64_t>(remaining.count(), 1000));
+            monitorIn();
         }
 
-        for (PcoThread *t : timeoutThreads) {
-            // wait for the timeout thread to end
-            t->join();
-            
-            // delete the timeout thread
-            delete t;
+        // Refuse new tasks, and no longer create threads
+        closed = true;
+
+        // Stop the timeout thread first so that it does not reap threads being stopped
+        timerThread->requestStop();
+        signal(timerCondition);
+        monitorOut();
+        cancelQueued(unexecuted);
+        timerThread->join();
+
+        monitorIn();
+        for (size_t i = 0; i < nbSlots; ++i) {
+            Worker *w = &workerRecords[i];
+            // request stop, threads which timed out have already ended
+            w->thread->requestStop();
+            // wake the thread up if it is blocked on its condition, or about to block on it
+            if (w->isWaiting) wakeUp(w);
+            else if (w->timedOut) signal(w->condition);
         }
+        monitorOut();
+        for (size_t i = 0; i < nbSlots; ++i) workerRecords[i].thread->join();
+
+        // Tasks queued by a submitter which went past the closed check just before it was set
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cancelQueued(unexecuted);
+        return unexecuted;
+    }
+
+    /* Same as shutdown(ShutdownMode::CancelPending) */
+    std::vector<std::unique_ptr<Runnable>> shutdownNow() {
+        return shutdown(ShutdownMode::CancelPending);
     }
 
     /*
@@ -76,56 +146,326 @@ public:
      * pool is at max capacity and there are less than maxNbWaiting threads waiting,
      * block the caller until a thread becomes available again, and else do not run the runnable.
      * If the runnable has been started, returns true, and else (the last case), return false.
+     * The runnable is queued in the given priority class, with the limit of this class.
+     * If it is still queued at the given deadline, it is dropped with cancelRun() instead of run.
+     */
+    bool start(std::unique_ptr<Runnable> runnable, Priority priority = Priority::Normal,
+               std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        Task task{std::move(runnable)};
+        task.priority = priority;
+        task.deadline = deadline;
+        return schedule(task, true);
+    }
+
+    /*
+     * Same admission rules as start(), but never blocks the caller: the runnable is either
+     * assigned to a thread or queued, and the call returns immediately. The returned handle
+     * can be used to wait for, poll or attach a continuation to the completion of the task.
+     * If the runnable is rejected, cancelRun() is called and the handle is already Cancelled.
+     * The task is dropped in the same way, when it is taken from the queue, if its deadline
+     * has passed or if TaskHandle::cancel() was called.
+     */
+    TaskHandle submit(std::unique_ptr<Runnable> runnable, Priority priority = Priority::Normal,
+                      std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        TaskHandle completion = statePool->acquire();
+        Task task{std::move(runnable), {}, completion};
+        task.priority = priority;
+        task.deadline = deadline;
+        schedule(task, false);
+        return completion;
+    }
+
+    /*
+     * Same as submit() for a callable taking no argument, returning a Future of its result:
+     * Future::get() returns the value, or rethrows the exception thrown by the callable.
+     * Callables of up to InlineFunction::INLINE_SIZE bytes are stored in the queue slot itself,
+     * and the state of the handle, which holds the result, comes from a free list, so that
+     * the steady-state path does not allocate. If the callable is rejected, the handle is
+     * already Cancelled.
+     */
+    template<typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F> &>>>
+    Future<std::invoke_result_t<std::decay_t<F> &>> submit(F &&function, Priority priority = Priority::Normal,
+                                                           std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        return submitCallable(std::forward<F>(function), nullptr, priority, deadline);
+    }
+
+    /*
+     * Start a range of std::unique_ptr<Runnable> in a single pass through the monitor. The
+     * runnables are moved out of the range and follow the admission rules of submit(): they
+     * are assigned to new threads while the pool can grow, then queued, and the ones exceeding
+     * maxNbWaiting are cancelled with cancelRun(). Only as many idle threads as queued runnables
+     * are woken up. Never blocks the caller and returns the number of runnables started.
      */
-    bool start(std::unique_ptr<Runnable> runnable) {
+    template<typename Iterator>
+    size_t startBatch(Iterator first, Iterator last, Priority priority = Priority::Normal) {
+        size_t nbStarted = 0;
+        size_t nbToWake = 0;
+
         monitorIn();
+        for (; first != last; ++first) {
+            Task task{std::move(*first)};
+            task.priority = priority;
+            task.startedAt = std::chrono::steady_clock::now();
 
-        // Check if the task can be processed
-        if (waiting.size() == maxNbWaiting) {
-            runnable->cancelRun();
-            monitorOut();
-            return false;
-        }
+            // Checked in the monitor, which shutdown() holds when closing the pool
+            if (closed) {
+                cancelTask(task);
+                continue;
+            }
 
-        if (nbWaiting() <= waiting.size() && currentNbThreads() < maxThreadCount) {
-            // Create a new thread if required
-            ++nbThread;
-            Condition *threadCondition = new Condition();
-            std::atomic<bool> *isWaiting = new std::atomic<bool>(false);
-            threads.push_back({
-                new PcoThread(&ThreadPool::execute, this, threadCondition, isWaiting, std::make_shared<RunnableWrapper>(std::move(runnable))),
-                threadCondition,
-                isWaiting,
-            });
-        } else {
-            std::shared_ptr<Condition> runnableCondition = std::make_shared<Condition>();
-            std::shared_ptr<std::atomic<bool>> runnableIsProcessed = std::make_shared<std::atomic<bool>>(false);
-
-            // Otherwise push a task to the queue
-            waiting.push({
-                std::move(runnable),
-                runnableIsProcessed,
-                runnableCondition,
-            });
+            // Create a new thread if the idle ones are not enough for the queued tasks and the pool can grow
+            if (nbThread < growthLimit() && nbIdle + nbSpinning <= nbQueued()) {
+                startThread(task);
+                ++nbStarted;
+                continue;
+            }
 
-            // Find and signal a waiting thread a task has arrived
-            for (auto t : threads) {
-                if (*t.isWaiting) {
-                    *t.isWaiting = false;
-                    signal(*t.condition);
-                    break;
-                }
+            if (enqueue(task)) {
+                ++nbStarted;
+                ++nbToWake;
+            } else {
+                cancelTask(task);
             }
-    
-            // Wait for the task to be processed
-            if (!*runnableIsProcessed) wait(*runnableCondition);
         }
 
+        // Signal as many idle threads as needed that tasks have arrived
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (; nbToWake > 0 && newestIdle; --nbToWake) wakeUp(newestIdle);
         monitorOut();
 
+        return nbStarted;
+    }
+
+    /*
+     * Returns a snapshot of the counters of the pool. The counters are read without entering
+     * the monitor, so the snapshot is not atomic as a whole.
+     */
+    ThreadPoolStats stats() {
+        ThreadPoolStats result;
+        result.tasksRejected = nbRejected.load(std::memory_order_relaxed);
+        result.tasksExpired = nbExpired.load(std::memory_order_relaxed);
+        result.tasksFailed = nbFailed.load(std::memory_order_relaxed);
+        result.threadsCreated = nbCreated.load(std::memory_order_relaxed);
+        result.threadsReaped = nbReaped.load(std::memory_order_relaxed);
+        result.threadsRetired = nbRetired.load(std::memory_order_relaxed);
+        result.queueDepth = nbQueued();
+        result.peakQueueDepth = peakQueueDepth.load(std::memory_order_relaxed);
+
+        size_t nbWorkers = nbSlots.load(std::memory_order_acquire);
+        for (size_t i = 0; i < nbWorkers; ++i) workerRecords[i].counters.addTo(result);
+        helperCounters.addTo(result);
+
+        return result;
+    }
+
+    /*
+     * Take one queued task and run it in the calling thread. Meant for a thread waiting on tasks
+     * of the pool, so that it helps instead of blocking idle (see parallel.h). Returns false if
+     * no task was waiting.
+     */
+    bool runPendingTask() {
+        Task task;
+        if (!takeTask(task)) return false;
+        runQueuedTask(nullptr, task);
         return true;
     }
 
+    /*
+     * Start or stop recording the timeline of each task run: the time it was given to the pool,
+     * taken from its queue, started and ended, with the id() of its runnable. Each thread keeps
+     * the last TraceRing::CAPACITY tasks it ran. Does nothing if PCO_TRACING is defined to 0.
+     */
+    void setTracing(bool enabled) {
+#if PCO_TRACING
+        tracing.store(enabled, std::memory_order_relaxed);
+#else
+        (void)enabled;
+#endif
+    }
+
+    /*
+     * Write the recorded timelines in the Chrome trace JSON format, which Perfetto and
+     * chrome://tracing open. Can be called while the pool runs tasks, which are still recorded.
+     */
+    void writeChromeTrace(std::ostream &out) {
+        std::vector<TraceTrack> tracks;
+#if PCO_TRACING
+        size_t nbWorkers = nbSlots.load(std::memory_order_acquire);
+        for (size_t i = 0; i < nbWorkers; ++i) {
+            tracks.push_back({"worker " + std::to_string(i), {}});
+            TraceRing *ring = workerRecords[i].trace.load(std::memory_order_acquire);
+            if (ring) ring->collect(tracks.back().events);
+        }
+        tracks.push_back({"helpers", {}});
+        helperTrace.collect(tracks.back().events);
+#endif
+        ::writeChromeTrace(out, tracks);
+    }
+
+    /* Write the trace to the given file, returns false if it could not be written. */
+    bool writeChromeTrace(const std::string &fileName) {
+        std::ofstream file(fileName);
+        if (!file) return false;
+        writeChromeTrace(file);
+        return static_cast<bool>(file);
+    }
+
+    /*
+     * Pin the threads created from now on to the given CPU sets, given to them in turn, for
+     * instance the nodes of CpuTopology::detect() to spread them over the NUMA nodes. An empty
+     * list stops pinning the new threads.
+     */
+    void setCpuSets(std::vector<std::vector<int>> sets) {
+        monitorIn();
+        cpuSets = std::move(sets);
+        nextCpuSet = 0;
+        monitorOut();
+    }
+
+    /*
+     * Set the maximum time an idle thread spins for a new task before parking: a longer spin
+     * lowers the latency of tasks arriving in quick succession at the cost of burnt CPU time.
+     * 0 parks the threads at once. Defaults to 50 us, or 0 on a single CPU.
+     */
+    void setSpinLimit(std::chrono::nanoseconds limit) {
+        spinLimit = limit.count();
+    }
+
+    /* Returns the maximum number of threads of the pool. */
+    int maxNbThreads() const {
+        return static_cast<int>(maxThreads.load());
+    }
+
+    /*
+     * Change at runtime the range of the number of threads, within the maxThreadCount given to
+     * the constructor. The minThreads first threads are not ended by the idle timeout, and the
+     * idle threads beyond maxThreads are ended at once.
+     */
+    void setThreadLimits(size_t minThreads, size_t maxThreads) {
+        monitorIn();
+        this->maxThreads = std::clamp<size_t>(maxThreads, 1, maxThreadCount);
+        this->minThreads = std::min(minThreads, this->maxThreads.load());
+        setTarget(elastic ? targetThreads.load() : this->maxThreads.load());
+        // The idle threads may now be beyond the maximum, or no longer within the minimum
+        signal(timerCondition);
+        monitorOut();
+    }
+
+    /*
+     * Number of threads the pool may create before queueing the tasks. Without elastic sizing
+     * it is the maximum number of threads; with it, it is moved by the size controller.
+     */
+    size_t targetNbThreads() const {
+        return targetThreads;
+    }
+
+    /* Set the target number of threads, within the limits; the controller may then move it */
+    void setTargetNbThreads(size_t target) {
+        monitorIn();
+        setTarget(target);
+        monitorOut();
+    }
+
+    /*
+     * Enable or disable the size controller. Every CONTROL_PERIOD_US, the timeout thread
+     * smooths the time the tasks waited in the queue: the target grows by half when this time
+     * stayed above growLatency with tasks queued for GROW_PERIODS periods, and shrinks by one
+     * thread when it stayed below growLatency / 4 with idle threads and an empty queue for
+     * SHRINK_PERIODS periods. The gap between both thresholds and the longer shrink delay keep
+     * a bursty load from creating and ending threads over and over. Idle threads beyond the
+     * target are ended, while the ones within it do not time out.
+     */
+    void setElasticSizing(bool enabled, std::chrono::microseconds growLatency = std::chrono::milliseconds{1}) {
+        monitorIn();
+        elastic = enabled;
+        this->growLatency = std::chrono::duration_cast<std::chrono::nanoseconds>(growLatency).count();
+        if (!enabled) setTarget(maxThreads);
+        signal(timerCondition);
+        monitorOut();
+    }
+
+    /* Queue wait time smoothed by the size controller, 0 if it is not enabled */
+    std::chrono::nanoseconds smoothedWaitTime() const {
+        return std::chrono::nanoseconds{static_cast<int64_t>(smoothedWait.load())};
+    }
+
+    /*
+     * Set the delay after which a priority class which has not been served is served before
+     * the higher ones, so that a flow of higher priority tasks cannot starve it.
+     */
+    void setAgingDelay(std::chrono::milliseconds delay) {
+        agingDelay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay).count();
+    }
+
+    class Tenant;
+    static constexpr size_t MAX_TENANTS = 16;
+
+    /*
+     * Create a tenant of the pool: a workload with its own queue of maxNbWaiting tasks, run by
+     * the threads of the pool. The threads share themselves between the tenants with tasks
+     * waiting, and the own queues of the pool counting as one tenant of weight 1, in
+     * proportion to their weights (stride scheduling): a busy tenant uses the capacity the
+     * others leave idle without starving them. Tenants live as long as the pool, at most
+     * MAX_TENANTS of them; throws std::length_error beyond.
+     */
+    Tenant createTenant(std::string name, size_t maxNbWaiting, unsigned weight = 1);
+
+    /*
+     * Awaitable resuming the awaiting coroutine on a thread of the pool: co_await pool.schedule().
+     * If the queue is full the coroutine goes on in the current thread. If the pool drops the
+     * task later, when it is shut down, the coroutine is resumed by the thread dropping it and
+     * the co_await throws TaskCancelled, so that nothing waits for it forever. Defined here with
+     * a generic await_suspend so that this header does not require C++20; see coro.h.
+     */
+    struct ScheduleAwaiter {
+        ThreadPool &pool;
+        bool dropped = false;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        template<typename Handle>
+        bool await_suspend(Handle handle) {
+            TaskHandle task = pool.submit([handle]() mutable { handle.resume(); });
+            if (task.status() == TaskHandle::Status::Cancelled) return false;
+
+            // The awaiter is not touched once the coroutine has been resumed, it may be gone
+            task.then([this, handle](TaskHandle::Status status) mutable {
+                if (status != TaskHandle::Status::Cancelled) return;
+                dropped = true;
+                handle.resume();
+            });
+            return true;
+        }
+
+        void await_resume() const {
+            if (dropped) throw TaskCancelled();
+        }
+    };
+
+    ScheduleAwaiter schedule() {
+        return ScheduleAwaiter{*this};
+    }
+
+    /*
+     * Token of the task running on the calling thread, to poll for its cancellation from its
+     * run(). Outside of a task of a ThreadPool, returns a token which is never cancelled.
+     */
+    static CancellationToken currentCancellationToken() {
+        return runningToken ? *runningToken : CancellationToken();
+    }
+
+    /*
+     * Scratch memory of the task running on the calling thread, also a std::pmr::memory_resource:
+     * allocating from it only bumps a pointer in memory owned by the thread, and everything the
+     * task allocated is given back once its run() returns, so nothing allocated from it may
+     * outlive the run. Outside of a task of a ThreadPool, returns nullptr.
+     */
+    static TaskArena *currentArena() {
+        return runningArena;
+    }
+
     /* Returns the number of currently running threads. They do not need to be executing a task,
      * just to be alive.
      */
@@ -134,100 +474,909 @@ public:
     }
 
 private:
+    // Longest sleep of the timeout thread before checking if it has to stop
+    static constexpr int64_t TIMER_SLICE_US = 10000;
+    static constexpr int64_t CONTROL_PERIOD_US = 10000;
+    static constexpr int GROW_PERIODS = 2;
+    static constexpr int SHRINK_PERIODS = 20;
 
-    size_t nbWaiting() {
-        int amount = 0;
-        for (struct Thread t : threads)
-            if (*t.isWaiting) ++amount;
+    // Virtual time a tenant of weight 1 advances by for each of its tasks
+    static constexpr uint64_t STRIDE_UNIT = 1 << 20;
 
-        return amount;
+    struct TenantState;
+
+    struct Task {
+        // Either a runnable or a callable
+        std::unique_ptr<Runnable> runnable{};
+        InlineFunction function{};
+        TaskHandle completion{};
+        // Released when the task is taken by a thread, if the caller of start() is blocked on it
+        std::shared_ptr<PcoSemaphore> dequeued{};
+        // Time the task was given to the pool
+        std::chrono::steady_clock::time_point startedAt{};
+        Priority priority = Priority::Normal;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+        // Time the task was taken from its queue, only set while tracing
+        std::chrono::steady_clock::time_point dequeuedAt{};
+        // Queued in the queue of this tenant rather than the one of its priority
+        TenantState *tenant = nullptr;
+    };
+
+    struct TenantState {
+        TenantState(std::string name, size_t maxNbWaiting, unsigned weight)
+            : name(std::move(name)), weight(weight), stride(STRIDE_UNIT / weight), queue(maxNbWaiting) {}
+
+        const std::string name;
+        const unsigned weight;
+        const uint64_t stride;
+        BoundedMpmcQueue<Task> queue;
+        // Virtual time of the next task of the tenant, see takeTask()
+        std::atomic<uint64_t> pass{0};
+        std::atomic<uint64_t> nbTaken{0};
+    };
+
+    /*
+     * State of a thread, in a contiguous array of records each starting on its own cache line.
+     * A record has three groups of fields, each starting on its own line: the ones set when the
+     * thread is created, which the thread then only reads or takes over, the ones other threads
+     * write under the monitor to put the thread to sleep or wake it up, and the ones only the
+     * thread writes while it runs.
+     */
+    struct alignas(64) Worker {
+        PcoThread *thread = nullptr;
+        // Task given to the thread when it is created
+        Task initialTask{};
+        // CPUs the thread is pinned to, none if it is not pinned
+        std::vector<int> cpus{};
+
+        alignas(64) Condition condition{};
+        bool isWaiting = false;
+        bool timedOut = false;
+        // Set with timedOut when the thread ends for being beyond the maximum or the target
+        bool retired = false;
+        std::chrono::steady_clock::time_point idleSince{};
+        Worker *previousIdle = nullptr;
+        Worker *nextIdle = nullptr;
+
+        // Mean time waited for a task, in nanoseconds, which sets the spin budget
+        alignas(64) int64_t meanIdleGap = 0;
+        // Timelines of the tasks run by the thread, allocated by it once tracing is enabled
+        std::atomic<TraceRing *> trace{nullptr};
+        WorkerCounters counters{};
+
+        ~Worker() {
+            delete trace.load();
+        }
+    };
+    static_assert(alignof(Worker) == 64, "Each Worker must start on its own cache line");
+    static_assert(offsetof(Worker, condition) % 64 == 0, "The fields written under the monitor must start a cache line");
+    static_assert(offsetof(Worker, meanIdleGap) % 64 == 0, "The fields written by the thread must start a cache line");
+    static_assert(offsetof(Worker, counters) % 64 == 0, "The counters must start a cache line");
+
+    /* Token and arena of the task running on the calling thread, see currentCancellationToken() and currentArena() */
+    static inline thread_local const CancellationToken *runningToken = nullptr;
+    static inline thread_local TaskArena *runningArena = nullptr;
+
+    /* Arena of the calling thread, reused by all the tasks it runs */
+    static TaskArena &threadArena() {
+        static thread_local TaskArena arena;
+        return arena;
+    }
+
+    /*
+     * Semaphore on which a thread blocked in start() waits for its task to be taken. It is
+     * allocated once per calling thread, and shared with the task so that it is still alive
+     * when the pool thread that released it returns from release(), even if the calling
+     * thread has ended in the meantime.
+     */
+    static const std::shared_ptr<PcoSemaphore> &startSemaphore() {
+        static thread_local std::shared_ptr<PcoSemaphore> semaphore = std::make_shared<PcoSemaphore>(0);
+        return semaphore;
+    }
+
+    template<typename F, typename R = std::invoke_result_t<std::decay_t<F> &>>
+    Future<R> submitCallable(F &&function, TenantState *tenant, Priority priority, std::chrono::steady_clock::time_point deadline) {
+        Future<R> completion(statePool->acquire());
+        Task task;
+        if constexpr (std::is_void_v<R>) {
+            task.function = InlineFunction(std::forward<F>(function));
+        } else {
+            // The task holds a reference on the state until it has completed
+            task.function = InlineFunction([function = std::decay_t<F>(std::forward<F>(function)), state = completion.state]() mutable {
+                state->template setValue<R>(function());
+            });
+        }
+        task.completion = completion;
+        task.tenant = tenant;
+        task.priority = priority;
+        task.deadline = deadline;
+        schedule(task, false);
+        return completion;
     }
 
-    void handleTimeout(std::shared_ptr<std::atomic<bool>> canTimeout, std::shared_ptr<std::atomic<bool>> stopRequested, Condition *condition, std::atomic<bool> *isWaiting) {
-        // Sleep for the timeout
-        PcoThread::thisThread()->usleep(1000 * idleTimeout.count());
-        
-        // Check if the parent thread found a task to run
-        if (*canTimeout) {
+    bool schedule(Task &task, bool blocking) {
+        task.startedAt = std::chrono::steady_clock::now();
+
+        // Check if the task can be processed
+        if (closed || queueOf(task).full()) {
+            cancelTask(task);
+            return false;
+        }
+
+        // Create a new thread if the idle ones are not enough for the queued tasks and the pool can grow
+        if (!closed && nbThread < growthLimit() && nbIdle + nbSpinning <= nbQueued()) {
+            monitorIn();
+            if (!closed && nbThread < growthLimit() && nbIdle + nbSpinning <= nbQueued()) {
+                startThread(task);
+                monitorOut();
+                return true;
+            }
+            monitorOut();
+        }
+
+        // Otherwise push a task to the queue, without going through the monitor
+        if (blocking) task.dequeued = startSemaphore();
+        PcoSemaphore *dequeued = task.dequeued.get();
+        if (!enqueue(task)) {
+            task.dequeued.reset();
+            cancelTask(task);
+            return false;
+        }
+
+        // Pairs with the fence in waitIdle(): either the thread going idle sees the task, or we see it idle.
+        // Pairs with the fence in shutdown() too: either its last cancelQueued() sees the task, or we see it closed
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (closed) {
+            // The pool was shut down since the check above and may not look at its queues again
+            std::vector<std::unique_ptr<Runnable>> dropped;
             monitorIn();
-            // Ask for stop
-            *stopRequested = true;
-            *isWaiting = false;
+            cancelQueued(dropped);
+            monitorOut();
+        } else if (nbIdle > 0 && nbQueued() > nbSpinning) {
+            // Signal the most recently idle thread a task has arrived, the oldest ones are left to time out
+            monitorIn();
+            if (newestIdle) wakeUp(newestIdle);
+            monitorOut();
+        } else if (nbThread == 0) {
+            // The last thread ended since the check above, see execute(): start one for the queued task
+            monitorIn();
+            if (!closed && nbThread == 0 && nbQueued() > 0) {
+                Task none;
+                startThread(none);
+            }
+            monitorOut();
+        }
+
+        // Wait for the task to be processed
+        if (dequeued) dequeued->acquire();
+
+        return true;
+    }
 
-            // Unlock parent thread blocked in wait
-            signal(*condition);
+    /*
+     * Number of threads the pool may grow to: the target, but at least one thread, so that the
+     * queued tasks are run even once the target has been set, or has shrunk, to 0.
+     */
+    size_t growthLimit() const {
+        return std::min(std::max<size_t>(targetThreads, 1), maxThreadCount);
+    }
+
+    BoundedMpmcQueue<Task> &queueOf(const Task &task) {
+        if (task.tenant) return task.tenant->queue;
+        return *waiting[static_cast<size_t>(task.priority)];
+    }
+
+    /* Number of tasks in the queues of the priority classes */
+    size_t nbOwnQueued() const {
+        size_t total = 0;
+        for (auto &queue : waiting) total += queue->size();
+        return total;
+    }
+
+    /* Number of tasks in all the queues, the ones of the tenants included */
+    size_t nbQueued() const {
+        size_t total = nbOwnQueued();
+        size_t tenantCount = nbTenants.load(std::memory_order_acquire);
+        for (size_t i = 0; i < tenantCount; ++i) total += tenants[i]->queue.size();
+        return total;
+    }
+
+    bool enqueue(Task &task) {
+        if (!queueOf(task).tryPush(task)) return false;
+
+        size_t depth = nbQueued();
+        size_t peak = peakQueueDepth.load(std::memory_order_relaxed);
+        while (depth > peak && !peakQueueDepth.compare_exchange_weak(peak, depth, std::memory_order_relaxed)) {}
+        return true;
+    }
+
+    /* Cancel every queued task, see shutdown() */
+    void cancelQueued(std::vector<std::unique_ptr<Runnable>> &unexecuted) {
+        std::vector<BoundedMpmcQueue<Task> *> queues;
+        for (auto &queue : waiting) queues.push_back(queue.get());
+        size_t tenantCount = nbTenants.load(std::memory_order_acquire);
+        for (size_t i = 0; i < tenantCount; ++i) queues.push_back(&tenants[i]->queue);
+
+        Task task;
+        for (BoundedMpmcQueue<Task> *queue : queues) {
+            while (queue->tryPop(task)) {
+                if (task.dequeued) {
+                    task.dequeued->release();
+                    task.dequeued.reset();
+                }
+                if (task.runnable) {
+                    task.runnable->cancelRun();
+                    unexecuted.push_back(std::move(task.runnable));
+                }
+                task.function.reset();
+                task.completion.complete(TaskHandle::Status::Cancelled);
+                task.completion = TaskHandle();
+            }
+        }
+    }
+
+    void cancelTask(Task &task) {
+        nbRejected.fetch_add(1, std::memory_order_relaxed);
+        if (task.runnable) task.runnable->cancelRun();
+        task.completion.complete(TaskHandle::Status::Cancelled);
+    }
+
+    /*
+     * Create a new thread running the given task first. The slot of a thread which timed
+     * out is reused if there is one, so that the number of slots never exceeds maxThreadCount.
+     * Must be called inside the monitor.
+     */
+    void startThread(Task &task) {
+        ++nbThread;
+        nbCreated.fetch_add(1, std::memory_order_relaxed);
+
+        Worker *worker;
+        if (!freeSlots.empty()) {
+            worker = freeSlots.back();
+            freeSlots.pop_back();
+
+            // The thread has left the monitor and is returning from execute()
+            worker->thread->join();
+            delete worker->thread;
+            worker->timedOut = false;
+            worker->retired = false;
+            worker->meanIdleGap = 0;
+        } else {
+            size_t slot = nbSlots.load(std::memory_order_relaxed);
+            worker = &workerRecords[slot];
+            nbSlots.store(slot + 1, std::memory_order_release);
+        }
+
+        if (cpuSets.empty()) worker->cpus.clear();
+        else worker->cpus = cpuSets[nextCpuSet++ % cpuSets.size()];
+
+        worker->initialTask = std::move(task);
+        worker->thread = new PcoThread(&ThreadPool::execute, this, worker);
+
+        // The idle threads are no longer all within the minimum: their timeouts count again
+        if (nbThread == minThreads + 1) signal(timerCondition);
+    }
+
+    /* Whether the tasks are traced, loaded once per task and passed along to runTask() */
+    bool tracingEnabled() const {
+#if PCO_TRACING
+        return tracing.load(std::memory_order_relaxed);
+#else
+        return false;
+#endif
+    }
+
+    void runTask(Worker *worker, Task &task, [[maybe_unused]] bool traced) {
+        auto begin = std::chrono::steady_clock::now();
+
+        // Shed the tasks nobody waits for anymore
+        if (begin >= task.deadline || task.completion.cancelRequested()) {
+            nbExpired.fetch_add(1, std::memory_order_relaxed);
+            if (task.runnable) task.runnable->cancelRun();
+            task.completion.complete(TaskHandle::Status::Cancelled);
+            task.runnable.reset();
+            task.function.reset();
+            task.completion = TaskHandle();
+            return;
+        }
+
+        // Restored afterwards, for a task run by a task helping in runPendingTask()
+        CancellationToken token(task.completion, task.deadline);
+        const CancellationToken *outerToken = std::exchange(runningToken, &token);
+        TaskArena &arena = threadArena();
+        TaskArena::Mark arenaMark = arena.mark();
+        TaskArena *outerArena = std::exchange(runningArena, &arena);
+        // An exception fails the handle of the task instead of ending the thread
+        std::exception_ptr error;
+        try {
+            if (task.runnable) task.runnable->run();
+            else task.function();
+        } catch (...) {
+            error = std::current_exception();
+            nbFailed.fetch_add(1, std::memory_order_relaxed);
+        }
+        runningToken = outerToken;
+        runningArena = outerArena;
+        arena.rewind(arenaMark);
+        auto end = std::chrono::steady_clock::now();
+#if PCO_TRACING
+        if (traced) traceTask(worker, task, begin, end);
+#endif
+        if (worker) {
+            worker->counters.recordTask(begin - task.startedAt, end - begin);
+        } else {
+            // Run by a thread helping in runPendingTask(), the counters may have several writers
+            helperMutex.lock();
+            helperCounters.recordTask(begin - task.startedAt, end - begin);
+            helperMutex.unlock();
+        }
+
+        if (error) task.completion.fail(error);
+        else task.completion.complete(TaskHandle::Status::Done);
+
+        // Release the resources of the task before looking for the next one
+        task.runnable.reset();
+        task.function.reset();
+        task.completion = TaskHandle();
+    }
+
+    void runQueuedTask(Worker *worker, Task &task) {
+        bool traced = tracingEnabled();
+        if (traced) task.dequeuedAt = std::chrono::steady_clock::now();
+
+        // Signal start method the task is processed
+        if (task.dequeued) {
+            task.dequeued->release();
+            task.dequeued.reset();
+        }
+
+        // Signal destructor if required no task is left
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (draining && nbQueued() == 0) {
+            monitorIn();
+            signal(stopCondition);
             monitorOut();
+        }
+
+        runTask(worker, task, traced);
+    }
+
+#if PCO_TRACING
+    void traceTask(Worker *worker, const Task &task, std::chrono::steady_clock::time_point begin,
+                   std::chrono::steady_clock::time_point end) {
+        auto sinceOrigin = [this](std::chrono::steady_clock::time_point time) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(time - traceOrigin).count();
+        };
+        TraceEvent event;
+        event.enqueued = sinceOrigin(task.startedAt);
+        // A task given to a new thread is not queued
+        event.dequeued = sinceOrigin(task.dequeuedAt == std::chrono::steady_clock::time_point{} ? begin : task.dequeuedAt);
+        event.started = sinceOrigin(begin);
+        event.ended = sinceOrigin(end);
+        setTraceName(event, task.runnable ? task.runnable->id() : std::string("function"));
+
+        if (worker) {
+            // Only the thread itself writes its ring
+            TraceRing *ring = worker->trace.load(std::memory_order_relaxed);
+            if (!ring) {
+                ring = new TraceRing();
+                worker->trace.store(ring, std::memory_order_release);
+            }
+            ring->record(event);
+        } else {
+            helperMutex.lock();
+            helperTrace.record(event);
+            helperMutex.unlock();
+        }
+    }
+#endif
 
+    /*
+     * Put a worker to sleep until a task arrives or its idle timeout expires. Idle workers are
+     * kept in an intrusive list ordered by the time they became idle: the oldest one, which is
+     * the next to time out, is at its head, and the newest one, which is woken first for a new
+     * task, is at its tail. Choosing, adding or removing an idle worker is therefore O(1)
+     * whatever the size of the pool. Returns without sleeping if a task was queued in the meantime.
+     * The worker sleeps as long as it is in the list rather than for a single signal: signaling
+     * the timeout thread hands it the monitor at once, and it may already have unlinked and
+     * signaled this worker before the worker reaches its wait.
+     */
+    void waitIdle(Worker *worker) {
+        worker->isWaiting = true;
+        worker->idleSince = std::chrono::steady_clock::now();
+        worker->previousIdle = newestIdle;
+        worker->nextIdle = nullptr;
+        if (newestIdle) newestIdle->nextIdle = worker;
+        else oldestIdle = worker;
+        newestIdle = worker;
+        ++nbIdle;
+
+        // Pairs with the fence in schedule()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (nbQueued() > 0) {
+            unlinkIdle(worker);
             return;
         }
+
+        // The timeout thread sleeps while no thread is idle
+        if (oldestIdle == worker) signal(timerCondition);
+
+        while (worker->isWaiting) wait(worker->condition);
     }
 
-    void execute(Condition *condition, std::atomic<bool> *isWaiting, std::shared_ptr<RunnableWrapper> task) {
-        // Execute the task given as parameter
-        std::unique_ptr<Runnable> runnable = std::move(task->release());
-        runnable->run();
-        
-        // Find new tasks to run
+    void unlinkIdle(Worker *worker) {
+        worker->isWaiting = false;
+        if (worker->previousIdle) worker->previousIdle->nextIdle = worker->nextIdle;
+        else oldestIdle = worker->nextIdle;
+        if (worker->nextIdle) worker->nextIdle->previousIdle = worker->previousIdle;
+        else newestIdle = worker->previousIdle;
+        worker->previousIdle = worker->nextIdle = nullptr;
+        --nbIdle;
+    }
+
+    /* Remove an idle worker from the idle list and wake it up. */
+    void wakeUp(Worker *worker) {
+        unlinkIdle(worker);
+        signal(worker->condition);
+    }
+
+    /*
+     * Routine of the single timeout thread of the pool. As every worker has the same idle
+     * timeout, the oldest idle worker always has the closest deadline: the thread sleeps until
+     * it expires and then stops that worker if it is still idle.
+     */
+    void handleTimeouts() {
+        auto nextControl = std::chrono::steady_clock::now();
+        monitorIn();
+        while (!PcoThread::thisThread()->stopRequested()) {
+            if (elastic && std::chrono::steady_clock::now() >= nextControl) {
+                controlSize();
+                nextControl = std::chrono::steady_clock::now() + std::chrono::microseconds{CONTROL_PERIOD_US};
+            }
+
+            // Threads beyond the maximum or the target of the controller end at once
+            if (oldestIdle && nbThread > (elastic ? targetThreads.load() : maxThreads.load())) {
+                oldestIdle->timedOut = true;
+                oldestIdle->retired = true;
+                wakeUp(oldestIdle);
+                continue;
+            }
+
+            // Threads within the minimum, or within the target of the controller, do not time out.
+            // Without the controller, nothing is left to do until a thread goes idle, a thread is
+            // created beyond the minimum or the limits change, which all signal timerCondition
+            if (!oldestIdle || nbThread <= (elastic ? targetThreads.load() : minThreads.load())) {
+                if (elastic) {
+                    monitorOut();
+                    PcoThread::usleep(CONTROL_PERIOD_US);
+                    monitorIn();
+                } else {
+                    wait(timerCondition);
+                }
+                continue;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            auto deadline = oldestIdle->idleSince + idleTimeout;
+            if (now < deadline) {
+                // Sleep outside the monitor, by slices so that the destructor does not wait too long
+                auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now);
+                monitorOut();
+                PcoThread::usleep(std::min<int64_t>(remaining.count(), TIMER_SLICE_US));
+                monitorIn();
+                continue;
+            }
+
+            // Ask the oldest idle thread to stop
+            oldestIdle->timedOut = true;
+            wakeUp(oldestIdle);
+        }
+        monitorOut();
+    }
+
+    /* Set the target number of threads, and create threads for the queued tasks if it grew */
+    void setTarget(size_t target) {
+        targetThreads = std::clamp(target, minThreads.load(), maxThreads.load());
+        for (size_t queued = nbQueued(); !closed && nbThread < growthLimit() && nbIdle + nbSpinning < queued; --queued) {
+            Task none;
+            startThread(none);
+        }
+    }
+
+    /* One period of the size controller, see setElasticSizing() */
+    void controlSize() {
+        uint64_t tasks = 0;
+        uint64_t waited = 0;
+        size_t nbWorkers = nbSlots.load(std::memory_order_acquire);
+        for (size_t i = 0; i < nbWorkers; ++i) {
+            tasks += workerRecords[i].counters.tasksExecuted.load(std::memory_order_relaxed);
+            waited += workerRecords[i].counters.waitNanoseconds.load(std::memory_order_relaxed);
+        }
+        tasks += helperCounters.tasksExecuted.load(std::memory_order_relaxed);
+        waited += helperCounters.waitNanoseconds.load(std::memory_order_relaxed);
+
+        // Mean wait of the tasks started during the period; a full queue without any task started counts as high
+        size_t queued = nbQueued();
+        double periodWait = 0;
+        if (tasks > controlTasks) {
+            periodWait = double(waited - controlWaited) / double(tasks - controlTasks);
+        } else if (queued > 0) {
+            periodWait = double(CONTROL_PERIOD_US) * 1000;
+        }
+        controlTasks = tasks;
+        controlWaited = waited;
+        smoothedWait = 0.75 * smoothedWait + 0.25 * periodWait;
+
+        if (smoothedWait > growLatency && queued > 0) {
+            nbLowPeriods = 0;
+            if (++nbHighPeriods >= GROW_PERIODS) {
+                nbHighPeriods = 0;
+                setTarget(targetThreads + std::max<size_t>(1, targetThreads / 2));
+            }
+        } else if (smoothedWait < growLatency / 4 && queued == 0 && nbIdle > 0) {
+            nbHighPeriods = 0;
+            if (++nbLowPeriods >= SHRINK_PERIODS) {
+                nbLowPeriods = 0;
+                setTarget(targetThreads > 0 ? targetThreads - 1 : 0);
+            }
+        } else {
+            nbHighPeriods = 0;
+            nbLowPeriods = 0;
+        }
+    }
+
+    /*
+     * Take the next task: from the highest priority class which has a task, unless a lower
+     * class has not been served for agingDelay, in which case that class goes first. A class
+     * is considered served when it is found empty too, so that its delay only runs while it
+     * has tasks waiting: the lower classes are checked for emptiness when a higher one has a
+     * task, otherwise a class left empty during a flow of higher tasks would go first as soon
+     * as a task arrives in it.
+     */
+    bool takeOwnTask(Task &task) {
+        int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+        int64_t delay = agingDelay.load(std::memory_order_relaxed);
+
+        for (size_t i = 1; i < NB_PRIORITIES; ++i) {
+            if (now - lastServed[i].load(std::memory_order_relaxed) > delay && waiting[i]->tryPop(task)) {
+                markServed(i, now);
+                return true;
+            }
+        }
+
+        for (size_t i = 0; i < NB_PRIORITIES; ++i) {
+            bool found = waiting[i]->tryPop(task);
+            markServed(i, now);
+            if (found) {
+                for (size_t lower = i + 1; lower < NB_PRIORITIES; ++lower) {
+                    if (waiting[lower]->empty()) markServed(lower, now);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * Take a task, sharing the threads between the tenants with tasks waiting by stride
+     * scheduling: each tenant has a virtual time, its pass, advanced by a stride inversely
+     * proportional to its weight for each task taken, and the tenant with the lowest pass goes
+     * first. A tenant which had no task starts again from the virtual time of the pool, so
+     * that it cannot bank the time it was idle. The own queues of the pool are one more tenant
+     * of weight 1. The passes are updated without lock, so concurrent threads only keep the
+     * shares approximately; without tenants, the own queues are served directly.
+     */
+    bool takeTask(Task &task) {
+        size_t tenantCount = nbTenants.load(std::memory_order_acquire);
+        if (tenantCount == 0) return takeOwnTask(task);
+
+        uint64_t now = virtualTime.load(std::memory_order_relaxed);
+        TenantState *best = nullptr;
+        bool ownFirst = false;
+        uint64_t bestPass = std::numeric_limits<uint64_t>::max();
+        if (nbOwnQueued() > 0) {
+            ownFirst = true;
+            bestPass = std::max(ownPass.load(std::memory_order_relaxed), now);
+        }
+        for (size_t i = 0; i < tenantCount; ++i) {
+            TenantState &tenant = *tenants[i];
+            if (tenant.queue.empty()) continue;
+            uint64_t pass = std::max(tenant.pass.load(std::memory_order_relaxed), now);
+            if (pass < bestPass) {
+                best = &tenant;
+                ownFirst = false;
+                bestPass = pass;
+            }
+        }
+
+        if (ownFirst && takeOwnTask(task)) {
+            ownPass.store(bestPass + STRIDE_UNIT, std::memory_order_relaxed);
+            virtualTime.store(bestPass, std::memory_order_relaxed);
+            return true;
+        }
+        if (best && best->queue.tryPop(task)) {
+            best->pass.store(bestPass + best->stride, std::memory_order_relaxed);
+            best->nbTaken.fetch_add(1, std::memory_order_relaxed);
+            virtualTime.store(bestPass, std::memory_order_relaxed);
+            return true;
+        }
+
+        // The chosen queue was emptied by another thread in the meantime, take any task
+        if (takeOwnTask(task)) return true;
+        for (size_t i = 0; i < tenantCount; ++i) {
+            if (tenants[i]->queue.tryPop(task)) {
+                tenants[i]->nbTaken.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void markServed(size_t priority, int64_t now) {
+        // Only write the shared timestamp when it is noticeably out of date, to keep its cache line shared
+        int64_t delay = agingDelay.load(std::memory_order_relaxed);
+        if (now - lastServed[priority].load(std::memory_order_relaxed) > delay / 8) {
+            lastServed[priority].store(now, std::memory_order_relaxed);
+        }
+    }
+
+    static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    /*
+     * Spin for a task before parking the thread, to save the wake up and context switch when
+     * tasks arrive close to each other: pause instructions first, then yielding the CPU for
+     * the second half of the budget. The budget follows the mean time the thread waited for
+     * its last tasks: twice that mean, up to spinLimit, and no spin at all once tasks arrive
+     * more than spinLimit apart, since parking then costs less than spinning.
+     * A spinning thread is counted in nbSpinning, so that submitters count on it instead of
+     * creating or waking other threads.
+     */
+    bool spinForTask(Worker *worker, Task &task) {
+        int64_t limit = spinLimit.load(std::memory_order_relaxed);
+        if (limit == 0 || worker->meanIdleGap > limit) return false;
+        // At least 1 us, unless the limit is lower
+        int64_t budget = std::min(std::max<int64_t>(2 * worker->meanIdleGap, 1000), limit);
+
+        // Pairs with the fence in schedule(): either we see the task, or the submitter sees us spinning
+        nbSpinning.fetch_add(1, std::memory_order_seq_cst);
+        auto begin = std::chrono::steady_clock::now();
         while (true) {
-            monitorIn();
+            if (takeTask(task)) break;
+            int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+            if (elapsed > budget || PcoThread::thisThread()->stopRequested()) {
+                nbSpinning.fetch_sub(1, std::memory_order_seq_cst);
+                return false;
+            }
+            if (elapsed < budget / 2) {
+                for (int i = 0; i < 16; ++i) cpuRelax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        nbSpinning.fetch_sub(1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    /* Update the mean time the thread waited for a task, used as its spin budget */
+    void recordIdleGap(Worker *worker, std::chrono::steady_clock::duration gap) {
+        worker->meanIdleGap = (7 * worker->meanIdleGap + std::chrono::duration_cast<std::chrono::nanoseconds>(gap).count()) / 8;
+    }
+
+    void execute(Worker *worker) {
+        if (!worker->cpus.empty()) pinCurrentThread(worker->cpus);
 
-            auto canTimeout = std::make_shared<std::atomic<bool>>(true);
-            auto stopRequested = std::make_shared<std::atomic<bool>>(false);
+        // Execute the task given at the creation of the thread, if any
+        if (worker->initialTask.runnable || worker->initialTask.function) runTask(worker, worker->initialTask, tracingEnabled());
+        Task queued;
 
-            if (waiting.empty() && !PcoThread::thisThread()->stopRequested()) {
-                // If the task queue is empty wait for a new task to arrive
-                *isWaiting = true;
-                timeoutThreads.push_back(new PcoThread(&ThreadPool::handleTimeout, this, canTimeout, stopRequested, condition, isWaiting));
-                wait(*condition);
-                *canTimeout = false;
+        // Find new tasks to run
+        while (true) {
+            // Take a task on the queue
+            if (takeTask(queued)) {
+                runQueuedTask(worker, queued);
+                continue;
+            }
+
+            auto idleBegin = std::chrono::steady_clock::now();
+            if (spinForTask(worker, queued)) {
+                recordIdleGap(worker, std::chrono::steady_clock::now() - idleBegin);
+                runQueuedTask(worker, queued);
+                continue;
             }
 
+            monitorIn();
+
+            // If the task queue is empty wait for a new task to arrive
+            if (!PcoThread::thisThread()->stopRequested()) waitIdle(worker);
+            recordIdleGap(worker, std::chrono::steady_clock::now() - idleBegin);
+
             // If a stop is required either by destructor or timeout, end thread
-            if (PcoThread::thisThread()->stopRequested() || *stopRequested) {
+            if (PcoThread::thisThread()->stopRequested() || worker->timedOut) {
                 --nbThread;
 
+                // Pairs with the fence in schedule(): either the last thread sees a task queued in
+                // the meantime and stays to run it, or the submitter sees no thread and starts one
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!PcoThread::thisThread()->stopRequested() && nbThread == 0 && nbQueued() > 0) {
+                    ++nbThread;
+                    worker->timedOut = false;
+                    worker->retired = false;
+                    monitorOut();
+                    continue;
+                }
+
+                // Give the slot back for the next thread creation
+                if (worker->timedOut) {
+                    (worker->retired ? nbRetired : nbReaped).fetch_add(1, std::memory_order_relaxed);
+                    freeSlots.push_back(worker);
+                }
+
                 monitorOut();
 
                 return;
             }
 
-            // Take a task on the queue
-            runnable = std::move(waiting.front().runnable);
-            
-            // Signal start method the task is processed
-            *waiting.front().isProcessed = true;
-            signal(*waiting.front().condition);
-            
-            waiting.pop();
-
-            // Signal destructor if required no task is left
-            if (waiting.empty()) signal(stopCondition);
-
             monitorOut();
-          
-            // Execute task
-            runnable->run();
         }
     }
 
     size_t maxThreadCount;
-    size_t maxNbWaiting;
+    std::array<size_t, NB_PRIORITIES> maxNbWaiting;
     std::chrono::milliseconds idleTimeout;
-    size_t nbThread = 0;
-    struct Thread {
-        PcoThread *thread;
-        Condition *condition;
-        std::atomic<bool> *isWaiting;
-    };
-    std::vector<struct Thread>threads{};
-    std::vector<PcoThread *> timeoutThreads{};
-    struct Task {
-        std::unique_ptr<Runnable> runnable;
-        std::shared_ptr<std::atomic<bool>> isProcessed;
-        std::shared_ptr<Condition> condition;
-    };
-    std::queue<struct Task> waiting{};
+    // Counters read by every submitter, each on its own cache line since they change at different rates
+    alignas(64) std::atomic<size_t> nbThread{0};
+    // Number of threads in the idle list, only modified inside the monitor
+    alignas(64) std::atomic<size_t> nbIdle{0};
+    // Number of threads spinning for a task before going idle
+    alignas(64) std::atomic<size_t> nbSpinning{0};
+    // Maximum spin before parking in nanoseconds, no spin on a single CPU where it only delays the others
+    alignas(64) std::atomic<int64_t> spinLimit{std::thread::hardware_concurrency() > 1 ? 50000 : 0};
+    // Records of the threads, maxThreadCount of them allocated at once, the nbSlots first ones in use
+    std::unique_ptr<Worker[]> workerRecords{};
+    std::atomic<size_t> nbSlots{0};
+    // Slots of the threads which timed out, to be joined and reused
+    std::vector<Worker *> freeSlots{};
+    Worker *oldestIdle = nullptr;
+    Worker *newestIdle = nullptr;
+    PcoThread *timerThread = nullptr;
+    Condition timerCondition{};
+    // One queue per priority class, indexed by Priority
+    std::array<std::unique_ptr<BoundedMpmcQueue<Task>>, NB_PRIORITIES> waiting{};
+    // Last time each class was served or found empty, in steady_clock ticks
+    std::array<std::atomic<int64_t>, NB_PRIORITIES> lastServed{};
+    // Tenants, which never move once created so that the threads read them without lock
+    std::array<std::unique_ptr<TenantState>, MAX_TENANTS> tenants{};
+    std::atomic<size_t> nbTenants{0};
+    // Virtual time of the last task taken, and pass of the own queues, see takeTask()
+    alignas(64) std::atomic<uint64_t> virtualTime{0};
+    std::atomic<uint64_t> ownPass{0};
+    alignas(64) std::atomic<int64_t> agingDelay{std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::milliseconds{100}).count()};
+    std::atomic<bool> draining{false};
+    std::atomic<bool> shutDown{false};
+    // Set by shutdown() once the queued tasks are no longer run
+    std::atomic<bool> closed{false};
+    std::shared_ptr<TaskStatePool> statePool;
+
+    // Range and target of the number of threads, only modified inside the monitor
+    std::atomic<size_t> minThreads{0};
+    std::atomic<size_t> maxThreads;
+    std::atomic<size_t> targetThreads;
+
+    // Size controller, run by the timeout thread
+    bool elastic = false;
+    int64_t growLatency = 1000000;
+    std::atomic<double> smoothedWait{0};
+    uint64_t controlTasks = 0;
+    uint64_t controlWaited = 0;
+    int nbHighPeriods = 0;
+    int nbLowPeriods = 0;
+
+    // CPU sets given in turn to the new threads, protected by the monitor
+    std::vector<std::vector<int>> cpuSets{};
+    size_t nextCpuSet = 0;
+
+    // Counters of the tasks run by threads helping in runPendingTask()
+    PcoMutex helperMutex{};
+    WorkerCounters helperCounters{};
+
+#if PCO_TRACING
+    // Only read with a relaxed load per task while it is off
+    std::atomic<bool> tracing{false};
+    const std::chrono::steady_clock::time_point traceOrigin = std::chrono::steady_clock::now();
+    // Timelines of the tasks run by threads helping in runPendingTask(), written under helperMutex
+    TraceRing helperTrace{};
+#endif
+
+    // Counters not owned by a thread, each on its own cache line
+    alignas(64) std::atomic<uint64_t> nbRejected{0};
+    alignas(64) std::atomic<uint64_t> nbExpired{0};
+    std::atomic<uint64_t> nbFailed{0};
+    alignas(64) std::atomic<size_t> peakQueueDepth{0};
+    alignas(64) std::atomic<uint64_t> nbCreated{0};
+    std::atomic<uint64_t> nbReaped{0};
+    std::atomic<uint64_t> nbRetired{0};
     Condition stopCondition{};
 };
 
+/*
+ * Handle on a tenant of a ThreadPool, see ThreadPool::createTenant(). start() and submit()
+ * follow the rules of the ones of the pool, with the queue and the maxNbWaiting of the tenant.
+ * Handles are cheap to copy and must not be used after the destruction of the pool.
+ */
+class ThreadPool::Tenant {
+public:
+    Tenant() = default;
+
+    bool start(std::unique_ptr<Runnable> runnable,
+               std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        Task task{std::move(runnable)};
+        task.tenant = state;
+        task.deadline = deadline;
+        return pool->schedule(task, true);
+    }
+
+    TaskHandle submit(std::unique_ptr<Runnable> runnable,
+                      std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        TaskHandle completion = pool->statePool->acquire();
+        Task task{std::move(runnable), {}, completion};
+        task.tenant = state;
+        task.deadline = deadline;
+        pool->schedule(task, false);
+        return completion;
+    }
+
+    template<typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F> &>>>
+    Future<std::invoke_result_t<std::decay_t<F> &>> submit(F &&function,
+                                                           std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        return pool->submitCallable(std::forward<F>(function), state, Priority::Normal, deadline);
+    }
+
+    const std::string &name() const {
+        return state->name;
+    }
+
+    unsigned weight() const {
+        return state->weight;
+    }
+
+    /* Number of tasks waiting in the queue of the tenant */
+    size_t queueDepth() const {
+        return state->queue.size();
+    }
+
+    /* Number of tasks taken from the queue of the tenant by the threads */
+    uint64_t nbTaken() const {
+        return state->nbTaken.load(std::memory_order_relaxed);
+    }
+
+private:
+    friend class ThreadPool;
+
+    Tenant(ThreadPool *pool, TenantState *state) : pool(pool), state(state) {}
+
+    ThreadPool *pool = nullptr;
+    TenantState *state = nullptr;
+};
+
+inline ThreadPool::Tenant ThreadPool::createTenant(std::string name, size_t maxNbWaiting, unsigned weight) {
+    monitorIn();
+    size_t index = nbTenants.load(std::memory_order_relaxed);
+    if (index == MAX_TENANTS) {
+        monitorOut();
+        throw std::length_error("ThreadPool: too many tenants");
+    }
+    tenants[index] = std::make_unique<TenantState>(std::move(name), maxNbWaiting, std::max(weight, 1u));
+    tenants[index]->pass.store(virtualTime.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // Published once complete, the threads read the tenants without entering the monitor
+    nbTenants.store(index + 1, std::memory_order_release);
+    monitorOut();
+    return Tenant(this, tenants[index].get());
+}
+
 #endif // THREADPOOL_H
@@ -0,0 +1,116 @@
+#ifndef THREADPOOLSTATS_H
+#define THREADPOOLSTATS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Latency histogram in nanoseconds, with the layout of an HDR histogram: each power of two of
+ * nanoseconds is split into SUB_BUCKETS linear buckets, and the durations below SUB_BUCKETS ns
+ * have a bucket each. The relative error of a percentile is therefore at most 1 / SUB_BUCKETS,
+ * whatever the magnitude of the durations, for a fixed number of buckets.
+ */
+struct LatencyHistogram {
+    static constexpr size_t SUB_BUCKET_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = size_t{1} << SUB_BUCKET_BITS;
+    static constexpr size_t NB_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    std::array<uint64_t, NB_BUCKETS> buckets{};
+
+    static size_t bucketOf(uint64_t nanoseconds) {
+        if (nanoseconds < SUB_BUCKETS) return static_cast<size_t>(nanoseconds);
+        size_t exponent = 63 - __builtin_clzll(nanoseconds);
+        size_t shift = exponent - SUB_BUCKET_BITS;
+        // The bits following the leading one select the linear bucket in the power of two
+        return (shift + 1) * SUB_BUCKETS + static_cast<size_t>((nanoseconds >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    /* Largest duration counted in the bucket */
+    static uint64_t upperBoundOf(size_t bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        size_t shift = bucket / SUB_BUCKETS - 1;
+        uint64_t lowest = uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+        return lowest + ((uint64_t{1} << shift) - 1);
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (uint64_t n : buckets) total += n;
+        return total;
+    }
+
+    /* Returns an upper bound of the given percentile (between 0 and 100), or 0 if the histogram is empty. */
+    std::chrono::nanoseconds percentile(double percent) const {
+        uint64_t total = count();
+        if (total == 0) return std::chrono::nanoseconds{0};
+
+        uint64_t rank = static_cast<uint64_t>(percent / 100.0 * (total - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < NB_BUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen >= rank) return std::chrono::nanoseconds{static_cast<int64_t>(std::min<uint64_t>(upperBoundOf(i), UINT64_MAX >> 1))};
+        }
+        return std::chrono::nanoseconds{UINT64_MAX >> 1};
+    }
+};
+
+/* Snapshot of the counters of a ThreadPool, returned by ThreadPool::stats(). */
+struct ThreadPoolStats {
+    uint64_t tasksExecuted = 0;
+    // Tasks refused because maxNbWaiting tasks were already waiting
+    uint64_t tasksRejected = 0;
+    // Tasks dropped when taken from the queue, past their deadline or cancelled
+    uint64_t tasksExpired = 0;
+    // Tasks whose run threw an exception
+    uint64_t tasksFailed = 0;
+    uint64_t threadsCreated = 0;
+    // Threads ended by their idle timeout
+    uint64_t threadsReaped = 0;
+    // Threads ended once idle for being beyond the maximum, or the target of the size controller
+    uint64_t threadsRetired = 0;
+    size_t queueDepth = 0;
+    size_t peakQueueDepth = 0;
+    // Time between the start of a task and the beginning of its execution
+    LatencyHistogram waitTime{};
+    // Execution time of the tasks
+    LatencyHistogram runTime{};
+};
+
+/*
+ * Counters of one pool thread. They are only written by that thread, so they are updated
+ * with plain relaxed stores instead of read-modify-write operations, and they are aligned
+ * on their own cache lines so that the threads do not share any line. stats() reads them
+ * without any lock.
+ */
+struct alignas(64) WorkerCounters {
+    std::atomic<uint64_t> tasksExecuted{0};
+    // Sum of the waitTime of the tasks, for the mean used by the size controller
+    std::atomic<uint64_t> waitNanoseconds{0};
+    std::array<std::atomic<uint64_t>, LatencyHistogram::NB_BUCKETS> waitTime{};
+    std::array<std::atomic<uint64_t>, LatencyHistogram::NB_BUCKETS> runTime{};
+
+    static void increment(std::atomic<uint64_t> &counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void recordTask(std::chrono::nanoseconds waited, std::chrono::nanoseconds ran) {
+        increment(tasksExecuted);
+        if (waited.count() > 0) waitNanoseconds.store(waitNanoseconds.load(std::memory_order_relaxed) + waited.count(), std::memory_order_relaxed);
+        increment(waitTime[LatencyHistogram::bucketOf(waited.count() > 0 ? waited.count() : 0)]);
+        increment(runTime[LatencyHistogram::bucketOf(ran.count() > 0 ? ran.count() : 0)]);
+    }
+
+    void addTo(ThreadPoolStats &stats) const {
+        stats.tasksExecuted += tasksExecuted.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < LatencyHistogram::NB_BUCKETS; ++i) {
+            stats.waitTime.buckets[i] += waitTime[i].load(std::memory_order_relaxed);
+            stats.runTime.buckets[i] += runTime[i].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+#endif // THREADPOOLSTATS_H
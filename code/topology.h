@@ -0,0 +1,107 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ * CPUs of each NUMA node of the machine, used to place the threads of the pools. A default
+ * constructed topology has a single node without any CPU, meaning the threads are not pinned.
+ */
+struct CpuTopology {
+    std::vector<std::vector<int>> nodes{{}};
+
+    size_t nbNodes() const {
+        return nodes.size();
+    }
+
+    /* Returns the node of the given CPU, or 0 if it is unknown. */
+    size_t nodeOfCpu(int cpu) const {
+        for (size_t node = 0; node < nodes.size(); ++node) {
+            for (int nodeCpu : nodes[node]) {
+                if (nodeCpu == cpu) return node;
+            }
+        }
+        return 0;
+    }
+
+    /* Parse a Linux CPU list such as "0-3,8,10-11". */
+    static std::vector<int> parseCpuList(const std::string &list) {
+        std::vector<int> cpus;
+        std::stringstream stream(list);
+        std::string range;
+        while (std::getline(stream, range, ',')) {
+            if (range.empty()) continue;
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    /*
+     * Read the NUMA nodes from sysfs (root/nodeN/cpulist). Nodes without CPU are skipped. If
+     * there is no such information, returns a single node with every CPU of the machine.
+     */
+    static CpuTopology detect(const std::string &root = "/sys/devices/system/node") {
+        CpuTopology topology;
+        topology.nodes.clear();
+
+        std::ifstream online(root + "/online");
+        std::string onlineList;
+        if (online && std::getline(online, onlineList)) {
+            for (int node : parseCpuList(onlineList)) {
+                std::ifstream file(root + "/node" + std::to_string(node) + "/cpulist");
+                std::string cpuList;
+                if (!file || !std::getline(file, cpuList)) continue;
+                std::vector<int> cpus = parseCpuList(cpuList);
+                if (!cpus.empty()) topology.nodes.push_back(std::move(cpus));
+            }
+        }
+
+        if (topology.nodes.empty()) {
+            std::vector<int> cpus;
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) cpus.push_back(cpu);
+            topology.nodes.push_back(std::move(cpus));
+        }
+        return topology;
+    }
+};
+
+/* Restrict the calling thread to the given CPUs. Returns false if it is not supported or failed. */
+inline bool pinCurrentThread(const std::vector<int> &cpus) {
+#ifdef __linux__
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+/* Returns the CPU the calling thread is running on, or -1 if it is unknown. */
+inline int currentCpu() {
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+#endif // TOPOLOGY_H
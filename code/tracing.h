@@ -0,0 +1,159 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Task timeline tracing of ThreadPool. It is compiled in unless PCO_TRACING is defined to 0,
+ * and then costs a single relaxed load per task while it is not enabled at runtime with
+ * ThreadPool::setTracing().
+ */
+#ifndef PCO_TRACING
+#define PCO_TRACING 1
+#endif
+
+/* Timeline of one task, in nanoseconds since the creation of the pool */
+struct TraceEvent {
+    int64_t enqueued = 0;
+    int64_t dequeued = 0;
+    int64_t started = 0;
+    int64_t ended = 0;
+    char name[24] = {};
+};
+
+/*
+ * Ring of the last CAPACITY task timelines of one thread. It has a single writer, the thread,
+ * and can be read at any time by another thread: each slot has a sequence number, odd while the
+ * slot is being written, so that a reader skips the slots overwritten during its copy. The
+ * fields are relaxed atomics so that these concurrent accesses are well defined.
+ */
+class TraceRing {
+public:
+    static constexpr size_t CAPACITY = 4096;
+
+    /* Writer only */
+    void record(const TraceEvent &event) {
+        uint64_t index = head.load(std::memory_order_relaxed);
+        Slot &slot = slots[index % CAPACITY];
+
+        slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.times[0].store(event.enqueued, std::memory_order_relaxed);
+        slot.times[1].store(event.dequeued, std::memory_order_relaxed);
+        slot.times[2].store(event.started, std::memory_order_relaxed);
+        slot.times[3].store(event.ended, std::memory_order_relaxed);
+        for (size_t i = 0; i < NAME_WORDS; ++i) {
+            uint64_t word;
+            std::memcpy(&word, event.name + i * sizeof(word), sizeof(word));
+            slot.name[i].store(word, std::memory_order_relaxed);
+        }
+        slot.sequence.store(2 * index + 2, std::memory_order_release);
+
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    /* Any thread: append the events of the ring, oldest first */
+    void collect(std::vector<TraceEvent> &events) const {
+        uint64_t end = head.load(std::memory_order_acquire);
+        uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+        for (uint64_t index = begin; index < end; ++index) {
+            const Slot &slot = slots[index % CAPACITY];
+            if (slot.sequence.load(std::memory_order_acquire) != 2 * index + 2) continue;
+
+            TraceEvent event;
+            event.enqueued = slot.times[0].load(std::memory_order_relaxed);
+            event.dequeued = slot.times[1].load(std::memory_order_relaxed);
+            event.started = slot.times[2].load(std::memory_order_relaxed);
+            event.ended = slot.times[3].load(std::memory_order_relaxed);
+            for (size_t i = 0; i < NAME_WORDS; ++i) {
+                uint64_t word = slot.name[i].load(std::memory_order_relaxed);
+                std::memcpy(event.name + i * sizeof(word), &word, sizeof(word));
+            }
+            event.name[sizeof(event.name) - 1] = '\0';
+
+            // Skip the slot if the writer went over it during the copy
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != 2 * index + 2) continue;
+            events.push_back(event);
+        }
+    }
+
+private:
+    static constexpr size_t NAME_WORDS = sizeof(TraceEvent::name) / sizeof(uint64_t);
+
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        std::array<std::atomic<int64_t>, 4> times{};
+        std::array<std::atomic<uint64_t>, NAME_WORDS> name{};
+    };
+
+    std::atomic<uint64_t> head{0};
+    std::unique_ptr<Slot[]> slots{new Slot[CAPACITY]};
+};
+
+/* Copy a task name into a TraceEvent, truncated to its size */
+inline void setTraceName(TraceEvent &event, const std::string &name) {
+    size_t length = std::min(name.size(), sizeof(event.name) - 1);
+    std::memcpy(event.name, name.data(), length);
+    event.name[length] = '\0';
+}
+
+/* Events of one thread, shown as a named track of the trace */
+struct TraceTrack {
+    std::string name;
+    std::vector<TraceEvent> events;
+};
+
+/*
+ * Write the tracks in the Chrome trace JSON format, which Perfetto and chrome://tracing open:
+ * one slice per task run on the track of its thread, and one asynchronous slice per task for
+ * its time in the queue.
+ */
+inline void writeChromeTrace(std::ostream &out, const std::vector<TraceTrack> &tracks) {
+    auto escaped = [](const char *name) {
+        std::string result;
+        for (const char *c = name; *c; ++c) {
+            if (*c == '"' || *c == '\\') result += '\\';
+            if (static_cast<unsigned char>(*c) >= 0x20) result += *c;
+        }
+        return result;
+    };
+    // Microseconds with the nanoseconds as decimals
+    auto micros = [](int64_t nanoseconds) {
+        return std::to_string(nanoseconds / 1000) + "." + std::to_string(1000 + nanoseconds % 1000).substr(1);
+    };
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    uint64_t asyncId = 0;
+    for (size_t tid = 0; tid < tracks.size(); ++tid) {
+        if (!first) out << ",\n";
+        first = false;
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+            << ",\"args\":{\"name\":\"" << escaped(tracks[tid].name.c_str()) << "\"}}";
+
+        for (const TraceEvent &event : tracks[tid].events) {
+            std::string name = escaped(event.name);
+            out << ",\n";
+            out << "{\"name\":\"" << name << "\",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                << ",\"ts\":" << micros(event.started) << ",\"dur\":" << micros(event.ended - event.started)
+                << ",\"args\":{\"waitUs\":" << micros(event.started - event.enqueued) << "}},\n";
+            ++asyncId;
+            out << "{\"name\":\"" << name << "\",\"cat\":\"queue\",\"ph\":\"b\",\"pid\":1,\"id\":" << asyncId
+                << ",\"ts\":" << micros(event.enqueued) << "},\n";
+            out << "{\"name\":\"" << name << "\",\"cat\":\"queue\",\"ph\":\"e\",\"pid\":1,\"id\":" << asyncId
+                << ",\"ts\":" << micros(event.dequeued) << "}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+#endif // TRACING_H
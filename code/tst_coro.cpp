@@ -0,0 +1,128 @@
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <pcosynchro/pcologger.h>
+#include <pcosynchro/pcothread.h>
+
+#include "threadpool.h"
+#include "coro.h"
+
+
+///
+/// \brief A coroutine moving itself to the pool and returning the square of its argument
+///
+static coro::task<int> square(ThreadPool &pool, int value)
+{
+    co_await pool.schedule();
+    co_return value * value;
+}
+
+///
+/// \brief A coroutine awaiting another one, without blocking its thread
+///
+static coro::task<int> sumOfSquares(ThreadPool &pool, int a, int b)
+{
+    co_await pool.schedule();
+    int first = co_await square(pool, a);
+    int second = co_await square(pool, b);
+    co_return first + second;
+}
+
+static coro::task<void> failing(ThreadPool &pool)
+{
+    co_await pool.schedule();
+    throw std::runtime_error("failed");
+}
+
+///
+/// \brief A coroutine polling the clock until a given delay, giving its thread back to the pool between checks
+///
+static coro::task<int> waitFor(ThreadPool &pool, int index, std::chrono::milliseconds delay)
+{
+    auto end = std::chrono::steady_clock::now() + delay;
+    while (std::chrono::steady_clock::now() < end) {
+        co_await pool.schedule();
+    }
+    co_return index;
+}
+
+
+///
+/// \brief Nested tasks, awaited from syncWait and from other tasks
+///
+TEST(CoroutineTest, testCase1)
+{
+    ThreadPool pool(2, 100, std::chrono::milliseconds{1000});
+    EXPECT_EQ(coro::syncWait(square(pool, 7)), 49);
+    EXPECT_EQ(coro::syncWait(sumOfSquares(pool, 3, 4)), 25);
+    EXPECT_THROW(coro::syncWait(failing(pool)), std::runtime_error);
+}
+
+///
+/// \brief 10000 logically concurrent tasks on a pool of 4 threads, through whenAll
+///
+TEST(CoroutineTest, testCase2)
+{
+    ThreadPool pool(4, 20000, std::chrono::milliseconds{1000});
+    const int nbTasks = 10000;
+
+    std::vector<coro::task<int>> tasks;
+    for (int i = 0; i < nbTasks; i++) tasks.push_back(square(pool, i % 100));
+    std::vector<int> results = coro::syncWait(coro::whenAll(std::move(tasks)));
+
+    ASSERT_EQ(results.size(), nbTasks);
+    for (int i = 0; i < nbTasks; i++) EXPECT_EQ(results[i], (i % 100) * (i % 100));
+    EXPECT_LE(pool.currentNbThreads(), 4);
+
+    std::vector<coro::task<void>> voids;
+    voids.push_back(failing(pool));
+    EXPECT_THROW(coro::syncWait(coro::whenAll(std::move(voids))), std::runtime_error);
+}
+
+///
+/// \brief whenAny returns the first task to complete while the others go on
+///
+TEST(CoroutineTest, testCase3)
+{
+    ThreadPool pool(4, 100, std::chrono::milliseconds{1000});
+
+    std::vector<coro::task<int>> tasks;
+    tasks.push_back(waitFor(pool, 0, std::chrono::milliseconds{100}));
+    tasks.push_back(waitFor(pool, 1, std::chrono::milliseconds{1}));
+    tasks.push_back(waitFor(pool, 2, std::chrono::milliseconds{100}));
+    auto [index, value] = coro::syncWait(coro::whenAny(std::move(tasks)));
+
+    EXPECT_EQ(index, 1);
+    EXPECT_EQ(value, 1);
+
+    // The pool must outlive the other tasks, which are still rescheduling themselves
+    PcoThread::usleep(1000 * 200);
+}
+
+///
+/// \brief A coroutine queued on the pool when it is shut down is resumed with TaskCancelled
+///
+TEST(CoroutineTest, testCase4)
+{
+    ThreadPool pool(1, 10, std::chrono::milliseconds{1000});
+    pool.submit([]() { PcoThread::usleep(1000 * 50); });
+
+    PcoThread stopper([&pool]() {
+        PcoThread::usleep(1000 * 10);
+        pool.shutdownNow();
+    });
+    EXPECT_THROW(coro::syncWait(square(pool, 3)), TaskCancelled);
+    stopper.join();
+}
+
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    logger().initialize(argc, argv);
+    PcoLogger::setVerbosity(1);
+    return RUN_ALL_TESTS();
+}
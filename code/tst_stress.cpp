@@ -0,0 +1,450 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <pcosynchro/pcologger.h>
+#include <pcosynchro/pcomutex.h>
+#include <pcosynchro/pcothread.h>
+
+#include "threadpool.h"
+
+/*
+ * Stress harness of ThreadPool::start(). A seed generates a scenario: the limits of the pool
+ * and, for each producer thread, the tasks it starts with their run times and the pauses
+ * between them, mixed with changes of the thread limits and of the target number of threads.
+ * The pool may be left idle, its threads timing out, before it is destroyed. The scenario runs
+ * with the producers racing each other, and checks that no task is lost or run twice, that the
+ * rejections are counted right, and that the pool never exceeds its maxThreadCount.
+ *
+ * Each operation takes a global sequence number when it is called, so that a run records the
+ * order in which the producers entered the pool. A failing run writes this schedule to
+ * stress_<seed>.log; PCO_STRESS_REPLAY=stress_<seed>.log replays it, the producers then being
+ * held so that they call the pool in the recorded order. The interleaving of the threads of
+ * the pool itself is left to the system. A run still going after RUN_TIMEOUT is most likely
+ * deadlocked: it is left to its threads and recorded as a failure, with the schedule so far.
+ *
+ * Environment: PCO_STRESS_SEED sets the first seed (random otherwise), PCO_STRESS_ROUNDS the
+ * number of seeds run from it (20 by default).
+ */
+
+//! Time after which a run is considered deadlocked
+static constexpr std::chrono::seconds RUN_TIMEOUT{30};
+
+//! Sequence of an operation the run has not reached
+static constexpr uint64_t NOT_REACHED = UINT64_MAX;
+
+///
+/// \brief One call of a producer to the pool: a start(), or a change of its number of threads
+///
+struct Operation {
+    enum class Kind : char { Start = 's', Limits = 'l', Target = 't' };
+
+    Kind kind = Kind::Start;
+    //! Index of the task in the scenario
+    size_t task = 0;
+    //! Run time of the task, in us
+    uint64_t runTimeUs = 0;
+    //! Pause of the producer before the call, in us
+    uint64_t pauseUs = 0;
+    //! Arguments of setThreadLimits(), or the target of setTargetNbThreads() in maxThreads
+    size_t minThreads = 0;
+    size_t maxThreads = 0;
+    //! Global order of the call, recorded by the run
+    uint64_t sequence = NOT_REACHED;
+    //! Result of start(), recorded by the run
+    bool accepted = false;
+};
+
+///
+/// \brief A scenario, generated from a seed or loaded from a recorded schedule
+///
+struct Scenario {
+    uint64_t seed = 0;
+    int maxThreadCount = 1;
+    int maxNbWaiting = 1;
+    int idleTimeoutMs = 1;
+    //! Time the pool is left idle before being destroyed, in ms
+    int idleBeforeDestroyMs = 0;
+    //! Operations of each producer, in the order it runs them
+    std::vector<std::vector<Operation>> producers{};
+
+    size_t nbTasks() const {
+        size_t total = 0;
+        for (const auto &operations : producers) total += operations.size();
+        return total;
+    }
+};
+
+static Scenario generateScenario(uint64_t seed)
+{
+    std::mt19937_64 random(seed);
+    auto uniform = [&random](int min, int max) { return std::uniform_int_distribution<int>(min, max)(random); };
+
+    Scenario scenario;
+    scenario.seed = seed;
+    scenario.maxThreadCount = uniform(1, 8);
+    scenario.maxNbWaiting = uniform(1, 16);
+    scenario.idleTimeoutMs = uniform(1, 20);
+    // Sometimes long enough for every thread to time out before the destruction
+    scenario.idleBeforeDestroyMs = uniform(0, 1) * uniform(0, 2 * scenario.idleTimeoutMs);
+    scenario.producers.resize(uniform(1, 8));
+
+    size_t task = 0;
+    for (auto &operations : scenario.producers) {
+        operations.resize(uniform(20, 100));
+        for (Operation &operation : operations) {
+            operation.task = task++;
+            // Shrink or grow the pool from time to time, down to a target of 0
+            int kind = uniform(0, 19);
+            if (kind == 0) {
+                operation.kind = Operation::Kind::Limits;
+                operation.minThreads = uniform(0, scenario.maxThreadCount);
+                operation.maxThreads = uniform(1, scenario.maxThreadCount);
+            } else if (kind == 1) {
+                operation.kind = Operation::Kind::Target;
+                operation.maxThreads = uniform(0, scenario.maxThreadCount);
+            }
+            // Mostly empty tasks to exercise the fast paths, and some long enough to fill the queue
+            operation.runTimeUs = uniform(0, 3) == 0 ? uniform(50, 2000) : 0;
+            // Pauses long enough for idle threads to time out from time to time
+            operation.pauseUs = uniform(0, 15) == 0 ? uniform(1000, 5000) : uniform(0, 1) * uniform(0, 50);
+        }
+    }
+    return scenario;
+}
+
+static void saveScenario(const Scenario &scenario, const std::string &fileName)
+{
+    std::ofstream file(fileName);
+    file << "seed " << scenario.seed << "\n";
+    file << "pool " << scenario.maxThreadCount << " " << scenario.maxNbWaiting << " " << scenario.idleTimeoutMs << " "
+         << scenario.idleBeforeDestroyMs << "\n";
+    for (size_t producer = 0; producer < scenario.producers.size(); ++producer) {
+        file << "producer " << producer << " " << scenario.producers[producer].size() << "\n";
+        for (const Operation &operation : scenario.producers[producer]) {
+            file << operation.sequence << " " << static_cast<char>(operation.kind) << " " << operation.task << " "
+                 << operation.runTimeUs << " " << operation.pauseUs << " " << operation.minThreads << " "
+                 << operation.maxThreads << " " << operation.accepted << "\n";
+        }
+    }
+}
+
+static bool loadScenario(const std::string &fileName, Scenario &scenario)
+{
+    std::ifstream file(fileName);
+    std::string keyword;
+    if (!(file >> keyword >> scenario.seed) || keyword != "seed") return false;
+    if (!(file >> keyword >> scenario.maxThreadCount >> scenario.maxNbWaiting >> scenario.idleTimeoutMs >> scenario.idleBeforeDestroyMs)
+        || keyword != "pool") {
+        return false;
+    }
+
+    scenario.producers.clear();
+    size_t producer, nbOperations;
+    while (file >> keyword >> producer >> nbOperations) {
+        if (keyword != "producer" || producer != scenario.producers.size()) return false;
+        std::vector<Operation> operations(nbOperations);
+        for (Operation &operation : operations) {
+            char kind;
+            if (!(file >> operation.sequence >> kind >> operation.task >> operation.runTimeUs >> operation.pauseUs
+                  >> operation.minThreads >> operation.maxThreads >> operation.accepted)) {
+                return false;
+            }
+            operation.kind = static_cast<Operation::Kind>(kind);
+        }
+        scenario.producers.push_back(std::move(operations));
+    }
+    return !scenario.producers.empty();
+}
+
+///
+/// \brief Counters of a run, updated by the tasks
+///
+struct RunState {
+    explicit RunState(size_t nbTasks) : runs(nbTasks), cancels(nbTasks) {}
+
+    std::vector<std::atomic<int>> runs;
+    std::vector<std::atomic<int>> cancels;
+    std::atomic<int> running{0};
+    std::atomic<int> maxRunning{0};
+    std::atomic<uint64_t> nextSequence{0};
+    std::atomic<bool> producersDone{false};
+    //! Protects the schedule recorded in the operations, read while the run hangs
+    PcoMutex recording{};
+};
+
+///
+/// \brief The Runnable of the harness, counting its runs and cancellations
+///
+class StressRunnable : public Runnable
+{
+    RunState &m_state;
+    size_t m_task;
+    uint64_t m_runTimeUs;
+
+public:
+    StressRunnable(RunState &state, size_t task, uint64_t runTimeUs) : m_state(state), m_task(task), m_runTimeUs(runTimeUs) {}
+
+    void run() override {
+        int running = m_state.running.fetch_add(1) + 1;
+        int max = m_state.maxRunning.load();
+        while (running > max && !m_state.maxRunning.compare_exchange_weak(max, running)) {}
+
+        m_state.runs[m_task]++;
+        if (m_runTimeUs > 0) PcoThread::usleep(m_runTimeUs);
+        m_state.running--;
+    }
+
+    void cancelRun() override {
+        m_state.cancels[m_task]++;
+    }
+
+    std::string id() override {
+        return "Stress" + std::to_string(m_task);
+    }
+};
+
+///
+/// \brief Runs the operations of a producer. When replaying, waits for the turn of each one, and
+/// stops at the first one the recorded run had not reached.
+///
+static void produce(ThreadPool *pool, RunState *state, std::vector<Operation> *operations, bool replay)
+{
+    for (Operation &operation : *operations) {
+        if (replay) {
+            if (operation.sequence == NOT_REACHED) return;
+            while (state->nextSequence.load() != operation.sequence) PcoThread::usleep(10);
+            state->nextSequence++;
+        } else {
+            if (operation.pauseUs > 0) PcoThread::usleep(operation.pauseUs);
+            state->recording.lock();
+            operation.sequence = state->nextSequence++;
+            state->recording.unlock();
+        }
+
+        switch (operation.kind) {
+        case Operation::Kind::Start: {
+            bool accepted = pool->start(std::make_unique<StressRunnable>(*state, operation.task, operation.runTimeUs));
+            state->recording.lock();
+            operation.accepted = accepted;
+            state->recording.unlock();
+            break;
+        }
+        case Operation::Kind::Limits:
+            pool->setThreadLimits(operation.minThreads, operation.maxThreads);
+            break;
+        case Operation::Kind::Target:
+            pool->setTargetNbThreads(operation.maxThreads);
+            break;
+        }
+    }
+}
+
+///
+/// \brief Samples the number of threads of the pool until the producers are done
+///
+static void sampleThreads(ThreadPool *pool, RunState *state, size_t *maxThreads)
+{
+    while (!state->producersDone) {
+        *maxThreads = std::max(*maxThreads, pool->currentNbThreads());
+        PcoThread::usleep(100);
+    }
+}
+
+///
+/// \brief Runs a scenario, recording its schedule unless replaying it, and returns the broken invariants
+///
+static std::vector<std::string> runScenario(Scenario &scenario, RunState &state, bool replay)
+{
+    std::vector<std::string> errors;
+    size_t maxThreads = 0;
+    size_t nbAccepted = 0;
+    size_t nbRefused = 0;
+    ThreadPoolStats stats;
+
+    {
+        ThreadPool pool(scenario.maxThreadCount, scenario.maxNbWaiting, std::chrono::milliseconds{scenario.idleTimeoutMs});
+        PcoThread sampler(sampleThreads, &pool, &state, &maxThreads);
+
+        std::vector<std::unique_ptr<PcoThread>> producers;
+        for (auto &operations : scenario.producers) {
+            producers.push_back(std::make_unique<PcoThread>(produce, &pool, &state, &operations, replay));
+        }
+        for (auto &producer : producers) producer->join();
+        state.producersDone = true;
+        sampler.join();
+
+        for (const auto &operations : scenario.producers) {
+            for (const Operation &operation : operations) {
+                if (operation.kind != Operation::Kind::Start || operation.sequence == NOT_REACHED) continue;
+                if (operation.accepted) nbAccepted++;
+                else nbRefused++;
+            }
+        }
+
+        // start() returns once its task is taken, so every accepted task is running or done
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+        stats = pool.stats();
+        while (stats.tasksExecuted < nbAccepted && std::chrono::steady_clock::now() < deadline) {
+            PcoThread::usleep(100);
+            stats = pool.stats();
+        }
+
+        // Let the threads time out, or be about to, while the pool is destroyed
+        PcoThread::usleep(1000 * scenario.idleBeforeDestroyMs);
+    }
+
+    if (stats.tasksExecuted != nbAccepted) {
+        errors.push_back(std::to_string(stats.tasksExecuted) + " tasks executed for " + std::to_string(nbAccepted) + " accepted");
+    }
+    if (stats.tasksRejected != nbRefused) {
+        errors.push_back(std::to_string(stats.tasksRejected) + " tasks counted as rejected for " + std::to_string(nbRefused) + " refused");
+    }
+    for (const auto &operations : scenario.producers) {
+        for (const Operation &operation : operations) {
+            if (operation.kind != Operation::Kind::Start || operation.sequence == NOT_REACHED) continue;
+            int runs = state.runs[operation.task];
+            int cancels = state.cancels[operation.task];
+            if (runs != (operation.accepted ? 1 : 0) || cancels != (operation.accepted ? 0 : 1)) {
+                errors.push_back("task " + std::to_string(operation.task) + " run " + std::to_string(runs) + " times and cancelled "
+                                 + std::to_string(cancels) + " times, start() returned " + (operation.accepted ? "true" : "false"));
+            }
+        }
+    }
+    if (maxThreads > size_t(scenario.maxThreadCount) || state.maxRunning > scenario.maxThreadCount) {
+        errors.push_back("up to " + std::to_string(maxThreads) + " threads and " + std::to_string(state.maxRunning.load())
+                         + " tasks running at once for a maxThreadCount of " + std::to_string(scenario.maxThreadCount));
+    }
+    return errors;
+}
+
+///
+/// \brief A run of a scenario in its own thread, shared with the thread waiting for it
+///
+struct Run {
+    explicit Run(const Scenario &scenario) : scenario(scenario), state(scenario.nbTasks()) {}
+
+    Scenario scenario;
+    RunState state;
+    std::vector<std::string> errors{};
+    std::atomic<bool> finished{false};
+};
+
+///
+/// \brief Runs a scenario like runScenario(), unless it is still running after RUN_TIMEOUT: the
+/// run is then left to its threads, and the scenario gets the schedule recorded so far
+///
+static std::vector<std::string> runWithTimeout(Scenario &scenario, bool replay)
+{
+    auto run = std::make_shared<Run>(scenario);
+    std::thread runner([run, replay]() {
+        run->errors = runScenario(run->scenario, run->state, replay);
+        run->finished = true;
+    });
+
+    auto deadline = std::chrono::steady_clock::now() + RUN_TIMEOUT;
+    while (!run->finished && std::chrono::steady_clock::now() < deadline) PcoThread::usleep(1000);
+    if (!run->finished) {
+        runner.detach();
+        run->state.recording.lock();
+        scenario = run->scenario;
+        run->state.recording.unlock();
+        return {"still running after " + std::to_string(RUN_TIMEOUT.count()) + " s, most likely deadlocked"};
+    }
+
+    runner.join();
+    scenario = run->scenario;
+    return run->errors;
+}
+
+static uint64_t environmentValue(const char *name, uint64_t defaultValue)
+{
+    const char *value = std::getenv(name);
+    return value ? std::strtoull(value, nullptr, 10) : defaultValue;
+}
+
+
+///
+/// \brief Random scenarios from PCO_STRESS_SEED, each failing one being written to stress_<seed>.log
+///
+TEST(StressTest, randomizedStart)
+{
+    uint64_t firstSeed = environmentValue("PCO_STRESS_SEED", std::random_device{}());
+    uint64_t nbRounds = environmentValue("PCO_STRESS_ROUNDS", 20);
+
+    for (uint64_t seed = firstSeed; seed < firstSeed + nbRounds; ++seed) {
+        Scenario scenario = generateScenario(seed);
+        std::vector<std::string> errors = runWithTimeout(scenario, false);
+        if (errors.empty()) continue;
+
+        std::string fileName = "stress_" + std::to_string(seed) + ".log";
+        saveScenario(scenario, fileName);
+        std::stringstream message;
+        message << "Seed " << seed << " failed, replay with PCO_STRESS_REPLAY=" << fileName << "\n";
+        for (size_t i = 0; i < std::min<size_t>(errors.size(), 10); ++i) message << "  " << errors[i] << "\n";
+        ADD_FAILURE() << message.str();
+    }
+}
+
+///
+/// \brief A recorded schedule is saved and loaded unchanged, and its replay calls start() in the recorded order
+///
+TEST(StressTest, scheduleRoundTrip)
+{
+    Scenario scenario = generateScenario(1);
+    EXPECT_TRUE(runWithTimeout(scenario, false).empty());
+
+    std::string fileName = "stress_roundtrip.log";
+    saveScenario(scenario, fileName);
+    Scenario loaded;
+    ASSERT_TRUE(loadScenario(fileName, loaded));
+    std::remove(fileName.c_str());
+
+    ASSERT_EQ(loaded.producers.size(), scenario.producers.size());
+    for (size_t producer = 0; producer < scenario.producers.size(); ++producer) {
+        ASSERT_EQ(loaded.producers[producer].size(), scenario.producers[producer].size());
+        for (size_t i = 0; i < scenario.producers[producer].size(); ++i) {
+            EXPECT_EQ(loaded.producers[producer][i].sequence, scenario.producers[producer][i].sequence);
+            EXPECT_EQ(loaded.producers[producer][i].task, scenario.producers[producer][i].task);
+            EXPECT_EQ(loaded.producers[producer][i].runTimeUs, scenario.producers[producer][i].runTimeUs);
+            EXPECT_EQ(loaded.producers[producer][i].kind, scenario.producers[producer][i].kind);
+            EXPECT_EQ(loaded.producers[producer][i].maxThreads, scenario.producers[producer][i].maxThreads);
+        }
+    }
+    EXPECT_EQ(loaded.idleBeforeDestroyMs, scenario.idleBeforeDestroyMs);
+    EXPECT_TRUE(runWithTimeout(loaded, true).empty());
+}
+
+///
+/// \brief Replays the schedule given by PCO_STRESS_REPLAY, if any
+///
+TEST(StressTest, replay)
+{
+    const char *fileName = std::getenv("PCO_STRESS_REPLAY");
+    if (!fileName) GTEST_SKIP() << "PCO_STRESS_REPLAY not set";
+
+    Scenario scenario;
+    ASSERT_TRUE(loadScenario(fileName, scenario)) << "Cannot read " << fileName;
+    std::vector<std::string> errors = runWithTimeout(scenario, true);
+    for (const std::string &error : errors) ADD_FAILURE() << error;
+}
+
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    logger().initialize(argc, argv);
+    PcoLogger::setVerbosity(1);
+    return RUN_ALL_TESTS();
+}
@@ -1,5 +1,11 @@
 
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+#include <sstream>
+#include <thread>
 
 #include <gtest/gtest.h>
 
@@ -8,11 +14,120 @@
 #include <pcosynchro/pcohoaremonitor.h>
 
 #include "threadpool.h"
+#include "workstealingpool.h"
+#include "parallel.h"
+#include "taskgraph.h"
 
 
 #define RUNTIME 100000
 #define RUNTIMEINMS 100
 
+//! Number of heap allocations of the measured threads during a measure, see countAllocations()
+static std::atomic<size_t> nbAllocations{0};
+
+//! Set while countAllocations() runs its measure
+static std::atomic<bool> measuringAllocations{false};
+
+//! Set on the threads whose allocations are measured: the test thread, and the pool threads through their tasks
+static thread_local bool allocationsMeasured = false;
+
+static void countAllocation()
+{
+    if (allocationsMeasured && measuringAllocations.load(std::memory_order_relaxed)) {
+        nbAllocations++;
+    }
+}
+
+//! Not inlined in the operators delete, where GCC would take the free() of memory from operator new for a mismatch
+[[gnu::noinline]] static void releaseMemory(void *ptr)
+{
+    std::free(ptr);
+}
+
+void *operator new(std::size_t size)
+{
+    countAllocation();
+    if (void *ptr = std::malloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    countAllocation();
+    auto align = static_cast<std::size_t>(alignment);
+    if (void *ptr = std::aligned_alloc(align, (size + align - 1) / align * align)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    releaseMemory(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    releaseMemory(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    releaseMemory(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+    releaseMemory(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    releaseMemory(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    releaseMemory(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept
+{
+    releaseMemory(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept
+{
+    releaseMemory(ptr);
+}
+
+///
+/// \brief countAllocations Runs measured() and returns the number of heap allocations made
+/// meanwhile by the calling thread and by the threads which set allocationsMeasured
+///
+template<typename Measured>
+static size_t countAllocations(Measured &&measured)
+{
+    allocationsMeasured = true;
+    size_t before = nbAllocations;
+    measuringAllocations = true;
+    measured();
+    measuringAllocations = false;
+    return nbAllocations - before;
+}
+
 ///
 /// \brief The ThreadpoolTest class
 /// This class embeds all the tests of the ThreadPool
@@ -113,6 +228,159 @@ public:
     /// \brief testCase5
     ///
     void testCase5();
+
+    ///
+    /// \brief testCase6 A testcase with a pool of 10 threads and 30 runnables submitted
+    /// without blocking. Check is done on the time spent submitting, on the completion
+    /// handles and on the continuations.
+    ///
+    void testCase6();
+
+    ///
+    /// \brief testCase7 A testcase checking that submit keeps the maxNbWaiting rejection.
+    ///
+    void testCase7();
+
+    ///
+    /// \brief testCase8 Same as testCase2 with the work-stealing engine.
+    ///
+    void testCase8();
+
+    ///
+    /// \brief testCase9 A testcase with runnables started from inside runnables of a
+    /// work-stealing pool, going to the local deques and being stolen by the other threads.
+    ///
+    void testCase9();
+
+    ///
+    /// \brief testCase10 A testcase with a pool of 200 threads running 2x200 runnables
+    ///
+    void testCase10();
+
+    ///
+    /// \brief testCase11 A testcase with a pool of 10 threads growing and shrinking 5 times.
+    ///
+    void testCase11();
+
+    ///
+    /// \brief testCase12 A testcase with a pool of 10 threads and 20 waiting slots starting
+    /// a batch of 40 runnables, 10 of which are rejected.
+    ///
+    void testCase12();
+
+    ///
+    /// \brief testCase13 A testcase submitting callables, checking that once the pool is
+    /// warmed up submitting and running them does not allocate.
+    ///
+    void testCase13();
+
+    ///
+    /// \brief testCase14 A testcase checking the counters returned by stats().
+    ///
+    void testCase14();
+
+    ///
+    /// \brief testCase15 A testcase with a pool of 1 thread checking the order of the
+    /// priority classes, their own maxNbWaiting limits and the aging of the lower classes.
+    ///
+    void testCase15();
+
+    ///
+    /// \brief testCase16 A testcase running parallel_for, parallel_reduce and parallel_sort
+    /// on a pool of 4 threads, and on a pool whose queue is too small for all the chunks.
+    ///
+    void testCase16();
+
+    ///
+    /// \brief testCase17 A testcase running a diamond-shaped TaskGraph several times, then
+    /// with a failing node whose downstream nodes must be cancelled.
+    ///
+    void testCase17();
+
+    ///
+    /// \brief testCase18 A testcase reading the CPU topology, running tasks on a ThreadPool
+    /// pinned to the NUMA nodes, and on a WorkStealingPool split in two nodes with hints.
+    ///
+    void testCase18();
+
+    ///
+    /// \brief testCase19 A testcase submitting tasks one after the other to threads spinning
+    /// before parking, then with spinning disabled.
+    ///
+    void testCase19();
+
+    ///
+    /// \brief testCase20 A testcase checking the minimum number of threads kept despite the
+    /// idle timeout, and the target of the size controller following the queue wait time.
+    ///
+    void testCase20();
+
+    ///
+    /// \brief testCase21 A testcase shutting pools down with pending tasks: cancelled at once,
+    /// then drained until a deadline.
+    ///
+    void testCase21();
+
+    ///
+    /// \brief testCase22 A testcase dropping queued tasks past their deadline or cancelled,
+    /// and cancelling a running task polling its token.
+    ///
+    void testCase22();
+
+    ///
+    /// \brief testCase23 A testcase exporting the timeline of the tasks as a Chrome trace
+    ///
+    void testCase23();
+
+    ///
+    /// \brief testCase24 A testcase sharing the threads between tenants by their weights
+    ///
+    void testCase24();
+
+    ///
+    /// \brief testCase25 A testcase getting the results and exceptions of tasks through futures
+    ///
+    void testCase25();
+
+    ///
+    /// \brief testCase26 A testcase allocating scratch memory of the tasks from the arena of their thread
+    ///
+    void testCase26();
+
+    ///
+    /// \brief testCase27 A testcase destroying pools while their threads time out
+    ///
+    void testCase27();
+
+    ///
+    /// \brief testCase28 A testcase submitting a Background task late in a flow of Realtime tasks
+    ///
+    void testCase28();
+
+    ///
+    /// \brief testCase29 A testcase with parallel algorithms whose function throws
+    ///
+    void testCase29();
+
+    ///
+    /// \brief testCase30 A testcase shutting down a pool with nodes of a TaskGraph queued
+    ///
+    void testCase30();
+
+    ///
+    /// \brief testCase31 A testcase lowering the maximum of a busy pool, and setting its target to 0
+    ///
+    void testCase31();
+
+    ///
+    /// \brief testCase32 A testcase starting tasks while, and after, the pool is shut down
+    ///
+    void testCase32();
+
+    ///
+    /// \brief testCase33 A testcase attaching a throwing continuation to tasks of both pools
+    ///
+    void testCase33();
 };
 
 
@@ -168,6 +436,114 @@ public:
 };
 
 
+///
+/// \brief The SpawningRunnable class
+/// A Runnable starting a number of TestRunnables on a work-stealing pool from inside its run()
+class SpawningRunnable : public Runnable
+{
+    ThreadpoolTest *m_tester;
+    WorkStealingPool *m_pool;
+    std::string m_id;
+    int m_nbChildren;
+
+public:
+    SpawningRunnable(ThreadpoolTest *tester, WorkStealingPool *pool, std::string id, int nbChildren)
+        : m_tester(tester), m_pool(pool), m_id(std::move(id)), m_nbChildren(nbChildren) {
+    }
+
+    void run() override {
+        for (int i = 0; i < m_nbChildren; i++) {
+            m_pool->start(std::make_unique<TestRunnable>(m_tester, m_id + "_" + std::to_string(i)));
+        }
+        m_tester->runnableTerminated(m_id);
+    }
+
+    std::string id() override {
+        return m_id;
+    }
+
+    void cancelRun() override {
+        m_tester->runnableTerminated(m_id);
+    }
+};
+
+
+///
+/// \brief The ThrowingRunnable class
+/// A Runnable whose run throws, to check that the thread running it survives
+class ThrowingRunnable : public Runnable
+{
+public:
+    void run() override {
+        throw std::runtime_error("ThrowingRunnable");
+    }
+
+    std::string id() override {
+        return "Throwing";
+    }
+
+    void cancelRun() override {}
+};
+
+///
+/// \brief The GraphRunnable class
+/// A Runnable appending its id to a shared string, or throwing if asked to, for the TaskGraph test
+class GraphRunnable : public Runnable
+{
+    PcoMutex *m_mutex;
+    std::string *m_order;
+    std::string m_id;
+    bool m_throws;
+
+public:
+    GraphRunnable(PcoMutex *mutex, std::string *order, std::string id, bool throws = false)
+        : m_mutex(mutex), m_order(order), m_id(std::move(id)), m_throws(throws) {
+    }
+
+    void run() override {
+        if (m_throws) throw std::runtime_error(m_id + " failed");
+        m_mutex->lock();
+        *m_order += m_id;
+        m_mutex->unlock();
+    }
+
+    std::string id() override {
+        return m_id;
+    }
+
+    void cancelRun() override {
+        m_mutex->lock();
+        *m_order += "~" + m_id;
+        m_mutex->unlock();
+    }
+};
+
+///
+/// \brief The CountingRunnable class
+/// A Runnable counting how many times it was run or cancelled, usable from several threads
+class CountingRunnable : public Runnable
+{
+    std::atomic<int> *m_nbRun;
+    std::atomic<int> *m_nbCancelled;
+
+public:
+    CountingRunnable(std::atomic<int> *nbRun, std::atomic<int> *nbCancelled) : m_nbRun(nbRun), m_nbCancelled(nbCancelled) {
+    }
+
+    void run() override {
+        (*m_nbRun)++;
+    }
+
+    std::string id() override {
+        return "Counting";
+    }
+
+    void cancelRun() override {
+        (*m_nbCancelled)++;
+    }
+};
+
+
 typedef struct {
     int thread_id;
     std::unique_ptr<TestRunnable> runnable;
@@ -186,6 +562,114 @@ void startInThread(ThreadParameter *param) {
 }
 
 
+///
+/// \brief destroyWithin Destroys the pool in another thread, and returns false if it takes longer
+/// than timeout. The pool is then left to its hung thread rather than blocking the other tests.
+///
+bool destroyWithin(std::unique_ptr<ThreadPool> pool, std::chrono::milliseconds timeout) {
+    auto destroyed = std::make_shared<std::atomic<bool>>(false);
+    std::thread destroyer([pool = std::move(pool), destroyed]() mutable {
+        pool.reset();
+        destroyed->store(true);
+    });
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!destroyed->load() && std::chrono::steady_clock::now() < deadline) PcoThread::usleep(1000);
+    if (!destroyed->load()) {
+        destroyer.detach();
+        return false;
+    }
+    destroyer.join();
+    return true;
+}
+
+
+///
+/// \brief Fills and empties queues of capacity 1 and 2 over several laps of their cells
+///
+TEST(BoundedMpmcQueueTest, smallCapacities)
+{
+    for (size_t capacity : {size_t{1}, size_t{2}}) {
+        BoundedMpmcQueue<int> queue(capacity);
+        int item = 0;
+        for (int lap = 0; lap < 5; ++lap) {
+            for (size_t i = 0; i < capacity; ++i) {
+                item = 10 * lap + static_cast<int>(i);
+                EXPECT_TRUE(queue.tryPush(item));
+            }
+            item = -1;
+            EXPECT_FALSE(queue.tryPush(item));
+            EXPECT_TRUE(queue.full());
+            for (size_t i = 0; i < capacity; ++i) {
+                EXPECT_TRUE(queue.tryPop(item));
+                EXPECT_EQ(item, 10 * lap + static_cast<int>(i));
+            }
+            EXPECT_FALSE(queue.tryPop(item));
+            EXPECT_TRUE(queue.empty());
+        }
+    }
+}
+
+///
+/// \brief Pushes from concurrent producers into queues of capacity 1 and 2: every item is popped
+/// once, and the single consumer never sees more items than the capacity
+///
+TEST(BoundedMpmcQueueTest, concurrentSmallCapacities)
+{
+    constexpr int NB_ITEMS = 20000;
+    for (size_t capacity : {size_t{1}, size_t{2}}) {
+        BoundedMpmcQueue<int> queue(capacity);
+        std::atomic<int> pushed{0};
+        std::vector<std::unique_ptr<PcoThread>> producers;
+        for (int p = 0; p < 3; ++p) {
+            producers.emplace_back(std::make_unique<PcoThread>([&]() {
+                for (int value = pushed.fetch_add(1) + 1; value <= NB_ITEMS; ) {
+                    int copy = value;
+                    if (queue.tryPush(copy)) value = pushed.fetch_add(1) + 1;
+                    else std::this_thread::yield();
+                }
+            }));
+        }
+
+        long sum = 0;
+        for (int popped = 0; popped < NB_ITEMS; ) {
+            EXPECT_LE(queue.size(), capacity);
+            int value;
+            if (queue.tryPop(value)) {
+                sum += value;
+                ++popped;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        for (auto &producer : producers) producer->join();
+        EXPECT_EQ(sum, long(NB_ITEMS) * (NB_ITEMS + 1) / 2);
+        int item;
+        EXPECT_FALSE(queue.tryPop(item));
+    }
+}
+
+///
+/// \brief Checks that the buckets of the latency histogram tile the durations, and that its
+/// percentiles are within 1 / SUB_BUCKETS of the recorded durations
+///
+TEST(LatencyHistogramTest, resolution)
+{
+    for (size_t bucket = 1; bucket < LatencyHistogram::NB_BUCKETS; ++bucket) {
+        uint64_t lowest = LatencyHistogram::upperBoundOf(bucket - 1) + 1;
+        EXPECT_EQ(LatencyHistogram::bucketOf(lowest), bucket);
+        EXPECT_EQ(LatencyHistogram::bucketOf(LatencyHistogram::upperBoundOf(bucket)), bucket);
+    }
+    EXPECT_EQ(LatencyHistogram::upperBoundOf(LatencyHistogram::NB_BUCKETS - 1), UINT64_MAX);
+
+    for (uint64_t duration : {uint64_t{5}, uint64_t{1000}, uint64_t{9000}, uint64_t{12345}, uint64_t{70000000}}) {
+        LatencyHistogram histogram;
+        histogram.buckets[LatencyHistogram::bucketOf(duration)] += 100;
+        auto p50 = static_cast<uint64_t>(histogram.percentile(50).count());
+        EXPECT_GE(p50, duration);
+        EXPECT_LE(p50 - duration, duration / LatencyHistogram::SUB_BUCKETS);
+    }
+}
+
 ///
 /// \brief A testcase with a pool of 10 threads running 10 runnables
 /// Each runnable just waits 10 ms and finishes.
@@ -397,6 +881,1106 @@ TEST_F(ThreadpoolTest, testCase5)
     }
 }
 
+///
+/// \brief A testcase with a pool of 10 threads and 30 runnables submitted without blocking
+/// Submitting must not wait for the runnables to be dequeued, so one producer keeps every
+/// thread busy. The completion handles and continuations must report every runnable.
+///
+TEST_F(ThreadpoolTest, testCase6)
+{
+    initTestCase();
+    ThreadPool pool(10, 50, std::chrono::milliseconds{100});
+    std::vector<TaskHandle> handles;
+    std::atomic<int> nbContinuations{0};
+
+    for(int i = 0; i < 30; i++) {
+        std::string runnableId = "Run" + std::to_string(i);
+        auto runnable = std::make_unique<TestRunnable>(this, runnableId);
+        runnableStarted(runnableId);
+        handles.push_back(pool.submit(std::move(runnable)));
+        handles.back().then([&nbContinuations](TaskHandle::Status status) {
+            if (status == TaskHandle::Status::Done) nbContinuations++;
+        });
+    }
+
+    auto submitTime = std::chrono::system_clock::now();
+    EXPECT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(submitTime - startingTime).count(), RUNTIMEINMS / 2) << "Submitting blocked the caller";
+
+    for (auto &handle : handles) {
+        EXPECT_EQ(handle.wait(), TaskHandle::Status::Done);
+        EXPECT_TRUE(handle.isDone());
+    }
+
+    // Check that every runnable is really finished
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << "Failed";
+    }
+
+    EXPECT_EQ(nbContinuations, 30);
+
+    EXPECT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (3 * RUNTIMEINMS + 30)) << "Too long execution time";
+
+    EXPECT_GT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (3 * RUNTIMEINMS - 30)) << "Too short execution time";
+}
+
+///
+/// \brief A testcase checking that submit keeps the maxNbWaiting rejection
+/// A pool of a single thread with a single waiting slot accepts two runnables,
+/// the third one is cancelled right away.
+///
+TEST_F(ThreadpoolTest, testCase7)
+{
+    initTestCase();
+    ThreadPool pool(1, 1, std::chrono::milliseconds{100});
+    std::vector<TaskHandle> handles;
+
+    for(int i = 0; i < 3; i++) {
+        std::string runnableId = "Run" + std::to_string(i);
+        auto runnable = std::make_unique<TestRunnable>(this, runnableId);
+        runnableStarted(runnableId);
+        handles.push_back(pool.submit(std::move(runnable)));
+    }
+
+    EXPECT_EQ(handles[2].status(), TaskHandle::Status::Cancelled);
+    EXPECT_EQ(handles[0].wait(), TaskHandle::Status::Done);
+    EXPECT_EQ(handles[1].wait(), TaskHandle::Status::Done);
+
+    // Check that every runnable is really finished
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << "Failed";
+    }
+}
+
+///
+/// \brief Same as testCase2 with the work-stealing engine
+///
+TEST_F(ThreadpoolTest, testCase8)
+{
+    initTestCase();
+    WorkStealingPool pool(10, 100);
+
+    // Starts the runnables
+    for(int i = 0; i < 100; i++) {
+        std::string runnableId = "Run" + std::to_string(i);
+        auto runnable = std::make_unique<TestRunnable>(this, runnableId);
+        runnableStarted(runnableId);
+        bool startStatus = pool.start(std::move(runnable));
+        EXPECT_TRUE(startStatus);
+    }
+
+    PcoThread::usleep(1000 * (10 * RUNTIMEINMS + 30));
+
+    // Check that every runnable is really finished
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << "Failed";
+    }
+
+    EXPECT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (10 * RUNTIMEINMS + 30)) << "Too long execution time";
+
+    EXPECT_GT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (10 * RUNTIMEINMS - 30)) << "Too short execution time";
+}
+
+///
+/// \brief A testcase with runnables started from inside runnables of a work-stealing pool
+/// A single runnable starts 40 runnables from its run(). They go to the deque of its thread,
+/// and must be stolen by the 9 others to finish in 4 rounds.
+///
+TEST_F(ThreadpoolTest, testCase9)
+{
+    initTestCase();
+    WorkStealingPool pool(10, 1);
+
+    runnableStarted("Spawner");
+    for (int i = 0; i < 40; i++) {
+        runnableStarted("Spawner_" + std::to_string(i));
+    }
+    EXPECT_TRUE(pool.start(std::make_unique<SpawningRunnable>(this, &pool, "Spawner", 40)));
+
+    PcoThread::usleep(1000 * (4 * RUNTIMEINMS + 30));
+
+    // Check that every runnable is really finished
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << "Failed";
+    }
+
+    EXPECT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (4 * RUNTIMEINMS + 30)) << "Too long execution time";
+
+    EXPECT_GT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (4 * RUNTIMEINMS - 30)) << "Too short execution time";
+}
+
+///
+/// \brief A testcase with a pool of 200 threads running 2x200 runnables
+/// A batch of 200 runnables is started, and after its completion, when every thread is idle,
+/// another batch is started. Check is done on the time required to run all the runnables.
+///
+TEST_F(ThreadpoolTest, testCase10)
+{
+    initTestCase();
+    ThreadPool pool(200, 200, std::chrono::milliseconds{1000});
+
+    for(int nbBatch = 0; nbBatch < 2; nbBatch ++) {
+        // Starts the runnables
+        for(int i = 0; i < 200; i++) {
+            std::string runnableId = "Run" + std::to_string(nbBatch) + "_" + std::to_string(i);
+            auto runnable = std::make_unique<TestRunnable>(this, runnableId);
+            runnableStarted(runnableId);
+            bool startStatus = pool.start(std::move(runnable));
+            EXPECT_TRUE(startStatus);
+        }
+
+        // Wait until completion of each runnable
+        PcoThread::usleep(1000 * (RUNTIMEINMS + 30));
+    }
+
+    // Check that every runnable is really finished
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << "Failed";
+    }
+
+    EXPECT_EQ(pool.currentNbThreads(), 200);
+
+    EXPECT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (2 * RUNTIMEINMS + 60)) << "Too long execution time";
+
+    EXPECT_GT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (2 * RUNTIMEINMS - 30)) << "Too short execution time";
+}
+
+///
+/// \brief A testcase with a pool of 10 threads growing and shrinking 5 times
+/// Each time, 10 runnables are started, then the idle timeout removes every thread, so the
+/// next batch creates its threads again in the slots of the ended ones.
+///
+TEST_F(ThreadpoolTest, testCase11)
+{
+    initTestCase();
+    ThreadPool pool(10, 100, std::chrono::milliseconds{5});
+
+    for(int nbBatch = 0; nbBatch < 5; nbBatch ++) {
+        // Starts the runnables
+        for(int i = 0; i < 10; i++) {
+            std::string runnableId = "Run" + std::to_string(nbBatch) + "_" + std::to_string(i);
+            auto runnable = std::make_unique<TestRunnable>(this, runnableId, RUNTIME / 5);
+            runnableStarted(runnableId);
+            bool startStatus = pool.start(std::move(runnable));
+            EXPECT_TRUE(startStatus);
+        }
+
+        EXPECT_EQ(pool.currentNbThreads(), 10);
+
+        // Wait until completion of each runnable and the timeout of each thread
+        PcoThread::usleep(1000 * (RUNTIMEINMS / 5 + 30));
+
+        EXPECT_EQ(pool.currentNbThreads(), 0);
+    }
+
+    // Check that every runnable is really finished
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << "Failed";
+    }
+}
+
+///
+/// \brief A testcase with a pool of 10 threads and 20 waiting slots starting a batch of 40 runnables
+/// 10 runnables go to new threads, 20 are queued and the 10 last ones are cancelled.
+/// Check is done on the termination of the Runnables (everyone finished), on the amount of
+/// cancelled runnables, and on the time required to run all the runnables.
+///
+TEST_F(ThreadpoolTest, testCase12)
+{
+    initTestCase();
+    ThreadPool pool(10, 20, std::chrono::milliseconds{100});
+    std::vector<std::unique_ptr<Runnable>> runnables;
+
+    for(int i = 0; i < 40; i++) {
+        std::string runnableId = "Run" + std::to_string(i);
+        runnableStarted(runnableId);
+        runnables.push_back(std::make_unique<TestRunnable>(this, runnableId));
+    }
+
+    EXPECT_EQ(pool.startBatch(runnables.begin(), runnables.end()), 30);
+
+    // The cancelled runnables are already terminated
+    int nbTerminated = 0;
+    for (const auto& [key, value] : m_runningState) {
+        if (!value) nbTerminated++;
+    }
+    EXPECT_EQ(nbTerminated, 10);
+
+    PcoThread::usleep(1000 * (3 * RUNTIMEINMS + 30));
+
+    // Check that every runnable is really finished
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << "Failed";
+    }
+
+    EXPECT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (3 * RUNTIMEINMS + 30)) << "Too long execution time";
+
+    EXPECT_GT(std::chrono::duration_cast<std::chrono::milliseconds>(endingTime - startingTime).count(), (3 * RUNTIMEINMS - 30)) << "Too short execution time";
+}
+
+///
+/// \brief A testcase submitting callables to a pool of 4 threads
+/// A first round of 1000 callables creates the threads and the completion states. The second
+/// round must reuse them and store the callables in the queue, without any heap allocation.
+/// A callable too big to be stored inline must still run.
+///
+TEST_F(ThreadpoolTest, testCase13)
+{
+    ThreadPool pool(4, 1000, std::chrono::milliseconds{1000});
+    std::atomic<int> nbRuns{0};
+    std::vector<TaskHandle> handles;
+    handles.reserve(1000);
+
+    // The callables also measure the allocations of the pool threads running them
+    auto submitRound = [&]() {
+        for (int i = 0; i < 1000; i++) {
+            handles.push_back(pool.submit([&nbRuns]() { allocationsMeasured = true; nbRuns++; }));
+        }
+        for (auto &handle : handles) {
+            EXPECT_EQ(handle.wait(), TaskHandle::Status::Done);
+        }
+        handles.clear();
+    };
+
+    submitRound();
+
+    EXPECT_EQ(countAllocations(submitRound), 0) << "Allocations on the submit path";
+
+    EXPECT_EQ(nbRuns, 2000);
+
+    std::array<char, 2 * InlineFunction::INLINE_SIZE> payload{};
+    payload.back() = 1;
+    EXPECT_EQ(pool.submit([payload, &nbRuns]() { nbRuns += payload.back(); }).wait(), TaskHandle::Status::Done);
+    EXPECT_EQ(nbRuns, 2001);
+}
+
+///
+/// \brief A testcase checking the counters returned by stats()
+/// A pool of 2 threads with 3 waiting slots gets 6 runnables of 20 ms: 2 run on new threads,
+/// 3 are queued and 1 is rejected. Both threads then time out.
+///
+TEST_F(ThreadpoolTest, testCase14)
+{
+    initTestCase();
+    ThreadPool pool(2, 3, std::chrono::milliseconds{5});
+    std::vector<TaskHandle> handles;
+
+    for(int i = 0; i < 6; i++) {
+        std::string runnableId = "Run" + std::to_string(i);
+        auto runnable = std::make_unique<TestRunnable>(this, runnableId, RUNTIME / 5);
+        runnableStarted(runnableId);
+        handles.push_back(pool.submit(std::move(runnable)));
+    }
+
+    ThreadPoolStats stats = pool.stats();
+    EXPECT_EQ(stats.queueDepth, 3);
+    EXPECT_EQ(stats.tasksRejected, 1);
+
+    for (auto &handle : handles) {
+        handle.wait();
+    }
+
+    // Wait for the timeout of the threads
+    PcoThread::usleep(1000 * 30);
+
+    stats = pool.stats();
+    EXPECT_EQ(stats.tasksExecuted, 5);
+    EXPECT_EQ(stats.tasksRejected, 1);
+    EXPECT_EQ(stats.threadsCreated, 2);
+    EXPECT_EQ(stats.threadsReaped, 2);
+    EXPECT_EQ(stats.threadsRetired, 0);
+    EXPECT_EQ(stats.queueDepth, 0);
+    EXPECT_EQ(stats.peakQueueDepth, 3);
+    EXPECT_EQ(stats.runTime.count(), 5);
+    EXPECT_EQ(stats.waitTime.count(), 5);
+    EXPECT_GE(stats.runTime.percentile(50), std::chrono::milliseconds{RUNTIMEINMS / 5});
+    EXPECT_GE(stats.waitTime.percentile(100), std::chrono::milliseconds{2 * RUNTIMEINMS / 5});
+}
+
+///
+/// \brief A pool of 1 thread busy with a first task while tasks of each priority class are
+/// submitted. They must run by class, and the Background class has its own limit. With a
+/// short aging delay, the Background task waiting since longer than it goes first.
+///
+TEST_F(ThreadpoolTest, testCase15)
+{
+    initTestCase();
+    PcoMutex mutex;
+    std::string order;
+    auto task = [&mutex, &order](char label) {
+        return [&mutex, &order, label]() {
+            mutex.lock();
+            order += label;
+            mutex.unlock();
+        };
+    };
+    auto blocker = []() { PcoThread::usleep(1000 * 30); };
+
+    {
+        ThreadPool pool(1, {2, 4, 2}, std::chrono::milliseconds{1000});
+        pool.submit(blocker);
+        pool.submit(task('b'), ThreadPool::Priority::Background);
+        pool.submit(task('b'), ThreadPool::Priority::Background);
+        EXPECT_EQ(pool.submit(task('x'), ThreadPool::Priority::Background).wait(), TaskHandle::Status::Cancelled);
+        pool.submit(task('n'));
+        pool.submit(task('n'));
+        pool.submit(task('r'), ThreadPool::Priority::Realtime);
+    }
+    EXPECT_EQ(order, "rnnbb");
+
+    order.clear();
+    {
+        ThreadPool pool(1, 10, std::chrono::milliseconds{1000});
+        pool.setAgingDelay(std::chrono::milliseconds{10});
+        pool.submit(blocker);
+        pool.submit(task('b'), ThreadPool::Priority::Background);
+        pool.submit(task('r'), ThreadPool::Priority::Realtime);
+    }
+    EXPECT_EQ(order, "br");
+}
+
+///
+/// \brief Parallel algorithms, including a nested parallel_for and a queue too small for the
+/// chunks, in which case the current thread processes them itself
+///
+TEST_F(ThreadpoolTest, testCase16)
+{
+    initTestCase();
+    const size_t size = 10000;
+
+    for (int maxNbWaiting : {64, 1}) {
+        ThreadPool pool(4, maxNbWaiting, std::chrono::milliseconds{1000});
+
+        std::vector<std::atomic<int>> visits(size);
+        parallel::parallel_for(pool, 0, size, 0, [&visits](size_t i) { visits[i]++; });
+        EXPECT_TRUE(std::all_of(visits.begin(), visits.end(), [](const std::atomic<int> &n) { return n == 1; }));
+
+        std::atomic<int> nbNested{0};
+        parallel::parallel_for(pool, 0, 10, 1, [&pool, &nbNested](size_t) {
+            parallel::parallel_for(pool, 0, 100, 10, [&nbNested](size_t) { nbNested++; });
+        });
+        EXPECT_EQ(nbNested, 1000);
+
+        uint64_t sum = parallel::parallel_reduce(pool, 0, size, 0, uint64_t{0},
+                                                 [](size_t i) { return uint64_t(i); },
+                                                 [](uint64_t a, uint64_t b) { return a + b; });
+        EXPECT_EQ(sum, uint64_t(size) * (size - 1) / 2);
+
+        std::vector<int> values(size);
+        srand(42);
+        for (int &value : values) value = rand() % 1000;
+        std::vector<int> expected = values;
+        std::sort(expected.begin(), expected.end());
+        parallel::parallel_sort(pool, values.begin(), values.end());
+        EXPECT_EQ(values, expected);
+    }
+}
+
+///
+/// \brief A diamond A -> (B, C) -> D run 3 times on the same graph, then a graph where B
+/// throws: D, after B, and E, after D, are cancelled while C still runs
+///
+TEST_F(ThreadpoolTest, testCase17)
+{
+    initTestCase();
+    ThreadPool pool(4, 10, std::chrono::milliseconds{1000});
+    PcoMutex mutex;
+    std::string order;
+
+    TaskGraph graph;
+    auto a = graph.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "A"));
+    auto b = graph.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "B"));
+    auto c = graph.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "C"));
+    auto d = graph.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "D"));
+    graph.addEdge(a, b);
+    graph.addEdge(a, c);
+    graph.addEdge(b, d);
+    graph.addEdge(c, d);
+
+    for (int i = 0; i < 3; i++) {
+        order.clear();
+        EXPECT_TRUE(graph.run(pool));
+        EXPECT_TRUE(order == "ABCD" || order == "ACBD") << order;
+    }
+
+    TaskGraph failing;
+    a = failing.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "A"));
+    b = failing.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "B", true));
+    c = failing.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "C"));
+    d = failing.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "D"));
+    auto e = failing.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "E"));
+    failing.addEdge(a, b);
+    failing.addEdge(a, c);
+    failing.addEdge(b, d);
+    failing.addEdge(c, d);
+    failing.addEdge(d, e);
+
+    order.clear();
+    EXPECT_FALSE(failing.run(pool));
+    EXPECT_EQ(order, "AC~D~E");
+    EXPECT_THROW(std::rethrow_exception(failing.firstError()), std::runtime_error);
+}
+
+///
+/// \brief CPU lists parsing, then tasks on pools placed on the NUMA nodes. The two nodes of
+/// the work-stealing pool share the first CPU of the machine, so that it runs anywhere.
+///
+TEST_F(ThreadpoolTest, testCase18)
+{
+    initTestCase();
+    EXPECT_EQ(CpuTopology::parseCpuList("0-3,8,10-11"), std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+
+    CpuTopology topology = CpuTopology::detect();
+    ASSERT_GE(topology.nbNodes(), 1);
+    EXPECT_FALSE(topology.nodes[0].empty());
+
+    {
+        ThreadPool pool(4, 20, std::chrono::milliseconds{1000});
+        pool.setCpuSets(topology.nodes);
+        for(int i = 0; i < 20; i++) {
+            std::string runnableId = "Pinned" + std::to_string(i);
+            runnableStarted(runnableId);
+            EXPECT_TRUE(pool.start(std::make_unique<TestRunnable>(this, runnableId, RUNTIME / 100)));
+        }
+    }
+
+    CpuTopology twoNodes;
+    twoNodes.nodes = {{topology.nodes[0][0]}, {topology.nodes[0][0]}};
+    {
+        WorkStealingPool pool(4, 100, twoNodes);
+        EXPECT_EQ(pool.nbNodes(), 2);
+        for(int i = 0; i < 100; i++) {
+            std::string runnableId = "Node" + std::to_string(i);
+            runnableStarted(runnableId);
+            EXPECT_TRUE(pool.start(std::make_unique<TestRunnable>(this, runnableId, RUNTIME / 100), i % 2));
+        }
+    }
+
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << key;
+    }
+}
+
+///
+/// \brief Tasks submitted one at a time, each one once the previous has completed, so that
+/// the thread finishing a task spins for the next one. The pool must not need more threads
+/// than with parking, and every task must run whatever the spin limit, even one below the
+/// minimum spin of 1 us.
+///
+TEST_F(ThreadpoolTest, testCase19)
+{
+    initTestCase();
+
+    for (auto limit : {std::chrono::nanoseconds{1000000}, std::chrono::nanoseconds{500}, std::chrono::nanoseconds{0}}) {
+        ThreadPool pool(4, 10, std::chrono::milliseconds{1000});
+        pool.setSpinLimit(limit);
+        std::atomic<int> nbRun{0};
+
+        for (int i = 0; i < 200; i++) {
+            pool.submit([&nbRun]() { nbRun++; }).wait();
+        }
+
+        EXPECT_EQ(nbRun, 200);
+        EXPECT_LE(pool.currentNbThreads(), 4);
+        EXPECT_EQ(pool.stats().tasksExecuted, 200);
+    }
+}
+
+///
+/// \brief First 2 of 4 threads kept by the minimum when the others time out, until the
+/// minimum is lowered. Then a pool controlled from a single thread: a backlog of 40 tasks of
+/// 20 ms makes its target grow, and once idle the target shrinks back one thread at a time.
+///
+TEST_F(ThreadpoolTest, testCase20)
+{
+    initTestCase();
+
+    {
+        ThreadPool pool(4, 10, std::chrono::milliseconds{5});
+        pool.setThreadLimits(2, 4);
+        std::vector<TaskHandle> handles;
+        for (int i = 0; i < 4; i++) handles.push_back(pool.submit([]() { PcoThread::usleep(1000 * 10); }));
+        for (auto &handle : handles) handle.wait();
+        EXPECT_EQ(pool.currentNbThreads(), 4);
+
+        PcoThread::usleep(1000 * 50);
+        EXPECT_EQ(pool.currentNbThreads(), 2);
+
+        // Without the minimum, the threads left idle time out too
+        pool.setThreadLimits(0, 4);
+        PcoThread::usleep(1000 * 50);
+        EXPECT_EQ(pool.currentNbThreads(), 0);
+    }
+
+    {
+        ThreadPool pool(8, 100, std::chrono::milliseconds{1000});
+        pool.setThreadLimits(1, 8);
+        pool.setElasticSizing(true, std::chrono::milliseconds{1});
+        pool.setTargetNbThreads(1);
+        EXPECT_EQ(pool.targetNbThreads(), 1);
+
+        std::vector<TaskHandle> handles;
+        for (int i = 0; i < 40; i++) handles.push_back(pool.submit([]() { PcoThread::usleep(1000 * 20); }));
+        for (auto &handle : handles) handle.wait();
+
+        size_t grown = pool.targetNbThreads();
+        EXPECT_GT(grown, 1);
+        EXPECT_LE(grown, 8);
+        EXPECT_GT(pool.smoothedWaitTime(), std::chrono::milliseconds{1});
+
+        PcoThread::usleep(1000 * 500);
+        EXPECT_LT(pool.targetNbThreads(), grown);
+        EXPECT_EQ(pool.currentNbThreads(), pool.targetNbThreads());
+    }
+}
+
+///
+/// \brief shutdownNow() on 2 threads running tasks of 50 ms with 10 runnables and a callable
+/// queued: the runnables are cancelled and returned, the callable handle is cancelled, and the
+/// two threads are joined together. Then a drain of tasks of 30 ms stopped by a deadline.
+///
+TEST_F(ThreadpoolTest, testCase21)
+{
+    initTestCase();
+
+    {
+        ThreadPool pool(2, 20, std::chrono::milliseconds{1000});
+        pool.submit([]() { PcoThread::usleep(1000 * 50); });
+        pool.submit([]() { PcoThread::usleep(1000 * 50); });
+        for(int i = 0; i < 10; i++) {
+            std::string runnableId = "Pending" + std::to_string(i);
+            runnableStarted(runnableId);
+            pool.submit(std::make_unique<TestRunnable>(this, runnableId));
+        }
+        TaskHandle callable = pool.submit([]() {});
+
+        auto begin = std::chrono::steady_clock::now();
+        auto unexecuted = pool.shutdownNow();
+        auto duration = std::chrono::steady_clock::now() - begin;
+
+        EXPECT_EQ(unexecuted.size(), 10);
+        EXPECT_EQ(callable.wait(), TaskHandle::Status::Cancelled);
+        EXPECT_LT(duration, std::chrono::milliseconds{90});
+        for (const auto& [key, value] : m_runningState) {
+            EXPECT_EQ(value, false) << key;
+        }
+
+        runnableStarted("Refused");
+        EXPECT_FALSE(pool.start(std::make_unique<TestRunnable>(this, "Refused")));
+        EXPECT_TRUE(pool.shutdownNow().empty());
+    }
+
+    {
+        ThreadPool pool(1, 20, std::chrono::milliseconds{1000});
+        std::atomic<int> nbRun{0};
+        for (int i = 0; i < 10; i++) pool.submit([&nbRun]() { PcoThread::usleep(1000 * 30); nbRun++; });
+        for(int i = 0; i < 10; i++) {
+            std::string runnableId = "Drained" + std::to_string(i);
+            runnableStarted(runnableId);
+            pool.submit(std::make_unique<TestRunnable>(this, runnableId));
+        }
+
+        auto unexecuted = pool.shutdown(ThreadPool::ShutdownMode::Drain, std::chrono::steady_clock::now() + std::chrono::milliseconds{100});
+        EXPECT_GE(nbRun, 2);
+        EXPECT_LT(nbRun, 10);
+        EXPECT_EQ(unexecuted.size(), 10);
+    }
+}
+
+///
+/// \brief A pool of 1 thread busy for 50 ms while 5 runnables with a deadline of 10 ms and a
+/// cancelled callable are queued: they are dropped instead of run. Then a running callable
+/// polling its token returns once its handle is cancelled.
+///
+TEST_F(ThreadpoolTest, testCase22)
+{
+    initTestCase();
+    ThreadPool pool(1, 20, std::chrono::milliseconds{1000});
+
+    pool.submit([]() { PcoThread::usleep(1000 * 50); });
+    std::vector<TaskHandle> handles;
+    for(int i = 0; i < 5; i++) {
+        std::string runnableId = "Stale" + std::to_string(i);
+        runnableStarted(runnableId);
+        handles.push_back(pool.submit(std::make_unique<TestRunnable>(this, runnableId), ThreadPool::Priority::Normal,
+                                      std::chrono::steady_clock::now() + std::chrono::milliseconds{10}));
+    }
+    std::atomic<bool> ran{false};
+    TaskHandle cancelled = pool.submit([&ran]() { ran = true; });
+    cancelled.cancel();
+
+    for (auto &handle : handles) EXPECT_EQ(handle.wait(), TaskHandle::Status::Cancelled);
+    EXPECT_EQ(cancelled.wait(), TaskHandle::Status::Cancelled);
+    EXPECT_FALSE(ran);
+    EXPECT_EQ(pool.stats().tasksExpired, 6);
+    for (const auto& [key, value] : m_runningState) {
+        EXPECT_EQ(value, false) << key;
+    }
+
+    std::atomic<int> nbPolls{0};
+    TaskHandle running = pool.submit([&nbPolls]() {
+        while (!ThreadPool::currentCancellationToken().isCancelled()) {
+            nbPolls++;
+            PcoThread::usleep(1000);
+        }
+    });
+    while (nbPolls == 0) PcoThread::usleep(1000);
+    running.cancel();
+    EXPECT_EQ(running.wait(), TaskHandle::Status::Done);
+    EXPECT_FALSE(ThreadPool::currentCancellationToken().isCancelled());
+}
+
+///
+/// \brief A pool of 2 threads tracing 4 runnables and a callable, then a runnable run once the
+/// tracing is stopped: the trace has a slice per traced task only, after their time in queue.
+///
+TEST_F(ThreadpoolTest, testCase23)
+{
+    initTestCase();
+    ThreadPool pool(2, 10, std::chrono::milliseconds{1000});
+
+    pool.setTracing(true);
+    std::vector<TaskHandle> handles;
+    for(int i = 0; i < 4; i++) {
+        std::string runnableId = "Traced" + std::to_string(i);
+        runnableStarted(runnableId);
+        handles.push_back(pool.submit(std::make_unique<TestRunnable>(this, runnableId, 1000)));
+    }
+    handles.push_back(pool.submit([]() {}));
+    for (auto &handle : handles) EXPECT_EQ(handle.wait(), TaskHandle::Status::Done);
+
+    pool.setTracing(false);
+    runnableStarted("Untraced");
+    EXPECT_EQ(pool.submit(std::make_unique<TestRunnable>(this, "Untraced", 1000)).wait(), TaskHandle::Status::Done);
+
+    std::stringstream trace;
+    pool.writeChromeTrace(trace);
+    std::string json = trace.str();
+
+    EXPECT_EQ(json.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0), 0);
+    size_t nbSlices = 0;
+    for (size_t pos = json.find("\"ph\":\"X\""); pos != std::string::npos; pos = json.find("\"ph\":\"X\"", pos + 1)) nbSlices++;
+    EXPECT_EQ(nbSlices, 5);
+    for(int i = 0; i < 4; i++) {
+        EXPECT_NE(json.find("\"name\":\"Traced" + std::to_string(i) + "\",\"cat\":\"task\""), std::string::npos);
+    }
+    EXPECT_NE(json.find("\"name\":\"function\""), std::string::npos);
+    EXPECT_EQ(json.find("Untraced"), std::string::npos);
+    EXPECT_NE(json.find("\"args\":{\"name\":\"worker 0\"}"), std::string::npos);
+}
+
+///
+/// \brief A pool of 1 thread kept busy while tenants of weights 3 and 1 queue 40 callables each:
+/// the first 20 run are shared 3 to 1. A third tenant with a limit of 2 refuses its third task
+/// while the others still accept theirs.
+///
+TEST_F(ThreadpoolTest, testCase24)
+{
+    initTestCase();
+    ThreadPool pool(1, 10, std::chrono::milliseconds{1000});
+    ThreadPool::Tenant heavy = pool.createTenant("heavy", 40, 3);
+    ThreadPool::Tenant light = pool.createTenant("light", 40, 1);
+    ThreadPool::Tenant small = pool.createTenant("small", 2);
+    EXPECT_EQ(heavy.name(), "heavy");
+    EXPECT_EQ(heavy.weight(), 3);
+
+    std::atomic<bool> go{false};
+    pool.submit([&go]() { while (!go) PcoThread::usleep(1000); });
+
+    PcoMutex mutex;
+    std::string order;
+    std::vector<TaskHandle> handles;
+    for (int i = 0; i < 40; i++) {
+        handles.push_back(heavy.submit([&]() { mutex.lock(); order += 'h'; mutex.unlock(); }));
+        handles.push_back(light.submit([&]() { mutex.lock(); order += 'l'; mutex.unlock(); }));
+    }
+    EXPECT_EQ(heavy.queueDepth(), 40);
+    EXPECT_EQ(small.submit([]() {}).status(), TaskHandle::Status::Pending);
+    EXPECT_EQ(small.submit([]() {}).status(), TaskHandle::Status::Pending);
+    EXPECT_EQ(small.submit([]() {}).status(), TaskHandle::Status::Cancelled);
+    EXPECT_EQ(pool.submit([]() {}).status(), TaskHandle::Status::Pending);
+
+    go = true;
+    for (auto &handle : handles) EXPECT_EQ(handle.wait(), TaskHandle::Status::Done);
+
+    ASSERT_EQ(order.size(), 80);
+    size_t nbHeavy = std::count(order.begin(), order.begin() + 20, 'h');
+    EXPECT_GE(nbHeavy, 14);
+    EXPECT_LE(nbHeavy, 16);
+    EXPECT_EQ(heavy.nbTaken(), 40);
+    EXPECT_EQ(light.nbTaken(), 40);
+    EXPECT_EQ(pool.stats().tasksRejected, 1);
+}
+
+///
+/// \brief A pool of 1 thread running callables returning values, small and big, chained with
+/// then(), and throwing: the exceptions reach the futures and the thread keeps running tasks.
+/// A task cancelled while queued makes get() throw TaskCancelled.
+///
+TEST_F(ThreadpoolTest, testCase25)
+{
+    initTestCase();
+    ThreadPool pool(1, 10, std::chrono::milliseconds{1000});
+
+    Future<int> answer = pool.submit([]() { return 42; });
+    EXPECT_EQ(answer.get(), 42);
+    EXPECT_EQ(answer.status(), TaskHandle::Status::Done);
+
+    std::array<int, 64> big{};
+    big.fill(7);
+    EXPECT_EQ(pool.submit([big]() { return big; }).get(), big);
+
+    Future<std::string> chained = pool.submit([]() { return 21; })
+                                      .then([](int value) { return value * 2; })
+                                      .then([](int value) { return std::to_string(value); });
+    EXPECT_EQ(chained.get(), "42");
+
+    Future<int> failed = pool.submit([]() -> int { throw std::runtime_error("failed"); });
+    EXPECT_THROW(failed.get(), std::runtime_error);
+    EXPECT_EQ(failed.status(), TaskHandle::Status::Failed);
+    Future<int> afterFailure = pool.submit([]() -> int { throw std::logic_error("failed"); }).then([](int value) { return value + 1; });
+    EXPECT_THROW(afterFailure.get(), std::logic_error);
+    Future<void> failingContinuation = pool.submit([]() {}).then([]() { throw std::runtime_error("continuation"); });
+    EXPECT_THROW(failingContinuation.get(), std::runtime_error);
+
+    EXPECT_EQ(pool.submit(std::make_unique<ThrowingRunnable>()).wait(), TaskHandle::Status::Failed);
+    EXPECT_EQ(pool.submit([]() { return 1; }).get(), 1);
+    EXPECT_EQ(pool.currentNbThreads(), 1);
+
+    std::atomic<bool> go{false};
+    pool.submit([&go]() { while (!go) PcoThread::usleep(1000); });
+    Future<int> cancelled = pool.submit([]() { return 0; });
+    cancelled.cancel();
+    go = true;
+    EXPECT_THROW(cancelled.get(), TaskCancelled);
+
+    EXPECT_EQ(pool.stats().tasksFailed, 3);
+}
+
+///
+/// \brief A pool of 1 thread running tasks which allocate scratch vectors from their arena: the
+/// memory is reused from one task to the next without allocating, and a task run by another one
+/// through runPendingTask() does not overwrite the memory of the outer task.
+///
+TEST_F(ThreadpoolTest, testCase26)
+{
+    initTestCase();
+    ThreadPool pool(1, 200, std::chrono::milliseconds{1000});
+    EXPECT_EQ(ThreadPool::currentArena(), nullptr);
+
+    auto scratch = []() {
+        allocationsMeasured = true;
+        std::pmr::vector<int> values(1000, 1, ThreadPool::currentArena());
+        return reinterpret_cast<uintptr_t>(values.data());
+    };
+    uintptr_t first = pool.submit(scratch).get();
+    EXPECT_NE(first, 0u);
+    EXPECT_EQ(pool.submit(scratch).get(), first);
+
+    // Keep more handles alive at once than in flight below, so that their states are allocated before the measure
+    std::vector<Future<uintptr_t>> handles;
+    for (int i = 0; i < 120; i++) handles.push_back(pool.submit(scratch));
+    for (auto &handle : handles) EXPECT_EQ(handle.get(), first);
+    handles.clear();
+
+    size_t nbScratchAllocations = countAllocations([&]() {
+        for (int i = 0; i < 100; i++) pool.submit(scratch);
+        EXPECT_EQ(pool.submit(scratch).get(), first);
+    });
+    EXPECT_EQ(nbScratchAllocations, 0) << "Allocations of scratch memory";
+
+    // A bigger allocation adds a chunk, merged with the first one once the task has returned
+    pool.submit([]() { std::pmr::vector<char> big(100 * 1024, 0, ThreadPool::currentArena()); }).get();
+    EXPECT_GE(pool.submit([]() { return ThreadPool::currentArena()->capacity(); }).get(), TaskArena::FIRST_CHUNK_SIZE + 100 * 1024);
+
+    bool outerIntact = pool.submit([&pool]() {
+        std::pmr::vector<int> outer(1000, 1, ThreadPool::currentArena());
+        pool.submit([]() { std::pmr::vector<int> inner(1000, 2, ThreadPool::currentArena()); });
+        EXPECT_TRUE(pool.runPendingTask());
+        std::pmr::vector<int> after(1000, 3, ThreadPool::currentArena());
+        return std::all_of(outer.begin(), outer.end(), [](int value) { return value == 1; });
+    }).get();
+    EXPECT_TRUE(outerIntact);
+}
+
+///
+/// \brief Pools destroyed at various points of the idle timeouts of their threads, some
+/// of them with a null timeout, and pools whose threads have all timed out. The destructor must
+/// never hang, and every thread created must have been reaped.
+///
+TEST_F(ThreadpoolTest, testCase27)
+{
+    // Destroy the pools at various points of the timeouts of their threads, a null timeout
+    // ending a thread as soon as it becomes idle
+    for (int round = 0; round < 20; ++round) {
+        auto pool = std::make_unique<ThreadPool>(8, 100, std::chrono::milliseconds{round % 2});
+        for (int i = 0; i < 8; ++i) pool->submit([]() { PcoThread::usleep(1000); });
+        PcoThread::usleep(1000 * (round % 5));
+        EXPECT_TRUE(destroyWithin(std::move(pool), std::chrono::milliseconds{5000})) << "round " << round;
+    }
+
+    // Let every thread time out before destroying the pool
+    for (int round = 0; round < 5; ++round) {
+        auto pool = std::make_unique<ThreadPool>(8, 100, std::chrono::milliseconds{2});
+        for (int i = 0; i < 8; ++i) pool->submit([]() { PcoThread::usleep(2000); });
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{2};
+        while (pool->currentNbThreads() > 0 && std::chrono::steady_clock::now() < deadline) PcoThread::usleep(1000);
+        EXPECT_EQ(pool->currentNbThreads(), 0u) << "round " << round;
+        EXPECT_EQ(pool->stats().threadsReaped, pool->stats().threadsCreated);
+        EXPECT_TRUE(destroyWithin(std::move(pool), std::chrono::milliseconds{5000})) << "round " << round;
+    }
+}
+
+///
+/// \brief A Background task submitted to a single thread pool after 250 ms of Realtime tasks,
+/// with an aging delay of 200 ms. The empty Background class has been served meanwhile, so the
+/// late task must wait the delay again and run after the Realtime task submitted behind it.
+///
+TEST_F(ThreadpoolTest, testCase28)
+{
+    ThreadPool pool(1, 100, std::chrono::milliseconds{1000});
+    pool.setAgingDelay(std::chrono::milliseconds{200});
+    PcoMutex mutex;
+    std::string order;
+    auto record = [&mutex, &order](char task) {
+        mutex.lock();
+        order += task;
+        mutex.unlock();
+    };
+
+    // The empty Background class is served too while the thread keeps finding Realtime tasks,
+    // so a Background task arriving late waits the aging delay again instead of going first
+    std::vector<TaskHandle> handles;
+    for (int i = 0; i < 30; ++i) {
+        handles.push_back(pool.submit([&record]() { PcoThread::usleep(10000); record('r'); }, ThreadPool::Priority::Realtime));
+    }
+    PcoThread::usleep(250000);
+    handles.push_back(pool.submit([&record]() { record('b'); }, ThreadPool::Priority::Background));
+    handles.push_back(pool.submit([&record]() { record('r'); }, ThreadPool::Priority::Realtime));
+    for (auto &handle : handles) handle.wait();
+
+    EXPECT_EQ(order, std::string(31, 'r') + "b");
+}
+
+///
+/// \brief parallel_for, parallel_reduce and parallel_sort with a function throwing in a
+/// chunk run by the pool or by the caller. The exception must reach the caller once no chunk is
+/// still running, and the pool must still be usable afterwards.
+///
+TEST_F(ThreadpoolTest, testCase29)
+{
+    ThreadPool pool(4, 100, std::chrono::milliseconds{100});
+    std::atomic<int> running{0};
+
+    // Throwing in a submitted half (the last chunk) and in the half run by the caller (the first one)
+    for (size_t failing : {size_t{395}, size_t{3}}) {
+        bool thrown = false;
+        try {
+            parallel::parallel_for(pool, 0, 400, 10, [&running, failing](size_t i) {
+                ++running;
+                PcoThread::usleep(50);
+                --running;
+                if (i == failing) throw std::runtime_error("chunk " + std::to_string(i));
+            });
+        } catch (const std::runtime_error &error) {
+            thrown = true;
+            EXPECT_EQ(std::string(error.what()), "chunk " + std::to_string(failing));
+            // No chunk may still run, or refer to the stack of the call
+            EXPECT_EQ(running, 0);
+        }
+        EXPECT_TRUE(thrown) << "failing index " << failing;
+    }
+
+    auto failingMap = [](size_t i) -> long {
+        if (i == 700) throw std::runtime_error("map");
+        return static_cast<long>(i);
+    };
+    EXPECT_THROW(parallel::parallel_reduce(pool, 0, 1000, 10, 0L, failingMap, std::plus<>()), std::runtime_error);
+
+    std::vector<int> values(1000);
+    for (size_t i = 0; i < values.size(); ++i) values[i] = static_cast<int>((i * 7919) % 1000);
+    auto failingCompare = [](int a, int b) {
+        if (a == 999 || b == 999) throw std::runtime_error("compare");
+        return a < b;
+    };
+    EXPECT_THROW(parallel::parallel_sort(pool, values.begin(), values.end(), 16, failingCompare), std::runtime_error);
+
+    // The pool is still usable afterwards
+    EXPECT_EQ(parallel::parallel_reduce(pool, 0, 1000, 10, 0L, [](size_t i) { return static_cast<long>(i); }, std::plus<>()), 499500);
+}
+
+///
+/// \brief A TaskGraph whose node b is queued behind a running task when shutdownNow()
+/// drops the queue. b and its successor c must both be cancelled, and wait() must return false
+/// instead of blocking.
+///
+TEST_F(ThreadpoolTest, testCase30)
+{
+    initTestCase();
+    ThreadPool pool(1, 10, std::chrono::milliseconds{100});
+    PcoMutex mutex;
+    std::string order;
+
+    // The node b is queued behind the running one when the pool drops its queue: it is cancelled,
+    // and so is its successor, instead of leaving wait() blocked
+    TaskGraph graph;
+    runnableStarted("Busy");
+    graph.addNode(std::make_unique<TestRunnable>(this, "Busy", 50000));
+    TaskGraph::NodeId b = graph.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "b"));
+    TaskGraph::NodeId c = graph.addNode(std::make_unique<GraphRunnable>(&mutex, &order, "c"));
+    graph.addEdge(b, c);
+
+    graph.start(pool);
+    PcoThread::usleep(10000);
+    pool.shutdownNow();
+
+    EXPECT_FALSE(graph.wait());
+    EXPECT_EQ(order, "~b~c");
+    EXPECT_EQ(m_runningState["Busy"], false);
+}
+
+///
+/// \brief The maximum of a busy pool lowered to 1: its idle threads beyond it must end at
+/// once, without waiting for their timeout. Then a pool with a target of 0, set by hand or by the
+/// size controller, which must still give a thread to every task.
+///
+TEST_F(ThreadpoolTest, testCase31)
+{
+    auto waitFor = [](const std::function<bool()> &condition) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{2};
+        while (!condition() && std::chrono::steady_clock::now() < deadline) PcoThread::usleep(1000);
+        return condition();
+    };
+
+    // The threads beyond the new maximum end once idle, without waiting for their timeout
+    auto pool = std::make_unique<ThreadPool>(4, 100, std::chrono::milliseconds{10000});
+    std::vector<TaskHandle> handles;
+    for (int i = 0; i < 8; ++i) handles.push_back(pool->submit([]() { PcoThread::usleep(20000); }));
+    EXPECT_EQ(pool->currentNbThreads(), 4);
+    pool->setThreadLimits(0, 1);
+    EXPECT_TRUE(waitFor([&handles]() {
+        return std::all_of(handles.begin(), handles.end(), [](TaskHandle &handle) { return handle.isDone(); });
+    }));
+    EXPECT_TRUE(waitFor([&pool]() { return pool->currentNbThreads() == 1; })) << pool->currentNbThreads() << " threads";
+    EXPECT_EQ(pool->stats().threadsRetired, 3);
+    EXPECT_EQ(pool->stats().threadsReaped, 0);
+    TaskHandle after = pool->submit([]() {});
+    EXPECT_TRUE(waitFor([&after]() { return after.isDone(); }));
+    EXPECT_TRUE(destroyWithin(std::move(pool), std::chrono::milliseconds{5000}));
+
+    // With a target of 0, the tasks still get a thread
+    pool = std::make_unique<ThreadPool>(2, 100, std::chrono::milliseconds{10000});
+    pool->setTargetNbThreads(0);
+    EXPECT_EQ(pool->targetNbThreads(), 0);
+    for (int i = 0; i < 200; ++i) {
+        TaskHandle handle = pool->submit([]() {});
+        ASSERT_TRUE(waitFor([&handle]() { return handle.isDone(); })) << "task " << i;
+        EXPECT_LE(pool->currentNbThreads(), 1);
+    }
+    EXPECT_LE(pool->currentNbThreads(), 1);
+    Future<int> result = pool->submit([]() { return 42; });
+    ASSERT_TRUE(waitFor([&result]() { return result.isDone(); }));
+    EXPECT_EQ(result.get(), 42);
+
+    // Same when the size controller shrinks the target to the default minimum of 0, its idle
+    // threads beyond the target then ending at once
+    pool->setTargetNbThreads(2);
+    pool->setElasticSizing(true);
+    EXPECT_TRUE(waitFor([&pool]() { return pool->targetNbThreads() == 0; }));
+    EXPECT_TRUE(waitFor([&pool]() { return pool->currentNbThreads() == 0; }));
+    TaskHandle late = pool->submit([]() {});
+    EXPECT_TRUE(waitFor([&late]() { return late.isDone(); }));
+    EXPECT_TRUE(destroyWithin(std::move(pool), std::chrono::milliseconds{5000}));
+}
+
+///
+/// \brief A batch started after shutdownNow(), which must be refused as a whole. Then tasks
+/// started and submitted from 4 threads while the pool shuts down: every task must be either run
+/// or cancelled, and no caller may stay blocked in start().
+///
+TEST_F(ThreadpoolTest, testCase32)
+{
+    initTestCase();
+
+    // A batch started after shutdownNow() is refused as a whole
+    {
+        ThreadPool pool(2, 10, std::chrono::milliseconds{1000});
+        pool.shutdownNow();
+        std::vector<std::unique_ptr<Runnable>> batch;
+        for (int i = 0; i < 5; i++) {
+            std::string runnableId = "Late" + std::to_string(i);
+            runnableStarted(runnableId);
+            batch.push_back(std::make_unique<TestRunnable>(this, runnableId));
+        }
+        EXPECT_EQ(pool.startBatch(batch.begin(), batch.end()), 0);
+        for (const auto& [key, value] : m_runningState) {
+            EXPECT_EQ(value, false) << key;
+        }
+    }
+
+    // Tasks started and submitted during the shutdown are all either run or cancelled, and the
+    // callers blocked in start() are released
+    for (int round = 0; round < 50; ++round) {
+        auto pool = std::make_unique<ThreadPool>(2, 4, std::chrono::milliseconds{1000});
+        std::atomic<int> nbRun{0};
+        std::atomic<int> nbCancelled{0};
+        std::atomic<int> nbStarters{0};
+        const int nbStarts = 50;
+
+        std::vector<std::thread> starters;
+        std::vector<std::vector<TaskHandle>> handles(4);
+        for (int t = 0; t < 4; ++t) {
+            starters.emplace_back([&, t]() {
+                for (int i = 0; i < nbStarts; ++i) {
+                    if (t % 2 == 0) pool->start(std::make_unique<CountingRunnable>(&nbRun, &nbCancelled));
+                    else handles[t].push_back(pool->submit(std::make_unique<CountingRunnable>(&nbRun, &nbCancelled)));
+                }
+                nbStarters++;
+            });
+        }
+        PcoThread::usleep(100 * (round % 10));
+        pool->shutdownNow();
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+        while (nbStarters < 4 && std::chrono::steady_clock::now() < deadline) PcoThread::usleep(1000);
+        if (nbStarters < 4) {
+            // Leave the pool to the blocked starters rather than blocking the other tests
+            for (auto &starter : starters) starter.detach();
+            pool.release();
+            FAIL() << "start() still blocked, round " << round;
+        }
+        for (auto &starter : starters) starter.join();
+
+        EXPECT_EQ(nbRun + nbCancelled, 4 * nbStarts) << "round " << round;
+        for (auto &threadHandles : handles) {
+            for (auto &handle : threadHandles) EXPECT_TRUE(handle.isDone()) << "round " << round;
+        }
+    }
+}
+
+///
+/// \brief A continuation throwing on the pool thread: the task stays Done, its waiters are
+/// woken and the thread goes on running tasks, in a ThreadPool and in a WorkStealingPool.
+///
+TEST_F(ThreadpoolTest, testCase33)
+{
+    initTestCase();
+    auto throwing = [](TaskHandle::Status) { throw std::runtime_error("continuation"); };
+
+    ThreadPool pool(1, 10, std::chrono::milliseconds{1000});
+    TaskHandle handle = pool.submit([]() { PcoThread::usleep(1000 * 20); });
+    handle.then(throwing);
+    EXPECT_EQ(handle.wait(), TaskHandle::Status::Done);
+    EXPECT_EQ(pool.submit([]() { return 42; }).get(), 42);
+
+    WorkStealingPool stealing(2, 10);
+    runnableStarted("Continued");
+    TaskHandle stolen = stealing.submit(std::make_unique<TestRunnable>(this, "Continued", 20000));
+    stolen.then(throwing);
+    EXPECT_EQ(stolen.wait(), TaskHandle::Status::Done);
+    EXPECT_EQ(stolen.status(), TaskHandle::Status::Done);
+    EXPECT_EQ(m_runningState["Continued"], false);
+}
+
 
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,450 @@
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <atomic>
+#include <exception>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <pcosynchro/pcothread.h>
+#include <pcosynchro/pcomutex.h>
+#include <pcosynchro/pcoconditionvariable.h>
+
+#include "threadpool.h"
+#include "topology.h"
+
+/*
+ * Chase-Lev work-stealing deque. The owner thread pushes and pops at the bottom, any other
+ * thread can steal from the top. The circular array grows when full; the replaced arrays
+ * are kept until the deque is destroyed since a thief may still be reading them.
+ */
+template<typename T>
+class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(int64_t capacity = 64) {
+        arrays.push_back(std::make_unique<Array>(capacity));
+        array.store(arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    /* Owner only */
+    void push(T item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Array *a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) a = grow(a, t, b);
+        a->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /* Owner only */
+    bool pop(T &item) {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Array *a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            // Empty deque
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        item = a->get(b);
+        if (t == b) {
+            // Last item, race against the thieves
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    /* Any thread */
+    bool steal(T &item) {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return false;
+
+        Array *a = array.load(std::memory_order_acquire);
+        item = a->get(t);
+        return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Array {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<T>[]> items;
+
+        explicit Array(int64_t capacity) : capacity(capacity), items(new std::atomic<T>[capacity]) {}
+
+        T get(int64_t index) const {
+            return items[index & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t index, T item) {
+            items[index & (capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    Array *grow(Array *old, int64_t t, int64_t b) {
+        arrays.push_back(std::make_unique<Array>(old->capacity * 2));
+        Array *a = arrays.back().get();
+        for (int64_t i = t; i < b; ++i) a->put(i, old->get(i));
+        array.store(a, std::memory_order_release);
+        return a;
+    }
+
+    std::atomic<int64_t> top{0};
+    std::atomic<int64_t> bottom{0};
+    std::atomic<Array *> array{nullptr};
+    std::vector<std::unique_ptr<Array>> arrays{};
+};
+
+/*
+ * Alternative engine to ThreadPool for short tasks on many cores. It takes the same Runnable
+ * objects and exposes the same start()/submit() interface, but each worker owns a
+ * WorkStealingDeque instead of sharing one monitor-protected queue:
+ * - runnables started from inside a Runnable::run() of this pool go to the local deque of the
+ *   running worker, without any lock;
+ * - runnables started from other threads go to a shared injection queue limited to
+ *   maxNbWaiting entries, beyond which they are cancelled as with ThreadPool;
+ * - a worker without local work takes from the injection queue, then steals from random
+ *   victims, and only parks when everything is empty.
+ * The maxThreadCount workers are started by the constructor and live until the destruction
+ * of the pool. start() never blocks the caller.
+ *
+ * Given a CpuTopology, the workers are spread over its NUMA nodes and pinned to the CPUs of
+ * their node. Each node then has its own injection queue and sleeping workers, a submission
+ * can hint its preferred node, and a worker only takes work from another node once its own
+ * node has none left.
+ *
+ * The Job records are reused instead of being allocated per task: each worker keeps the ones it
+ * ran in a list of its own, for the runnables it starts itself, and gives the ones beyond
+ * LOCAL_FREE_JOBS to a list shared with the submitters from other threads.
+ */
+class WorkStealingPool {
+public:
+    WorkStealingPool(int maxThreadCount, int maxNbWaiting)
+        : WorkStealingPool(maxThreadCount, maxNbWaiting, CpuTopology()) {}
+
+    /* maxNbWaiting is the limit of the injection queue of each node */
+    WorkStealingPool(int maxThreadCount, int maxNbWaiting, const CpuTopology &topology)
+        : maxNbWaiting(maxNbWaiting) {
+        for (auto &cpus : topology.nodes) {
+            nodes.push_back(std::make_unique<Node>());
+            nodes.back()->cpus = cpus;
+        }
+        if (nodes.empty()) nodes.push_back(std::make_unique<Node>());
+
+        workers.reserve(maxThreadCount);
+        for (int i = 0; i < maxThreadCount; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+            // Seed the victim selection so that the workers do not all target the same victims
+            workers.back()->seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+            workers.back()->node = i % nodes.size();
+            nodes[workers.back()->node]->workers.push_back(workers.back().get());
+        }
+        for (auto &w : workers) w->thread = new PcoThread(&WorkStealingPool::execute, this, w.get());
+    }
+
+    ~WorkStealingPool() {
+        // Wait for all tasks to be processed
+        drainedMutex.lock();
+        while (nbPending.load() > 0) drainedCondition.wait(&drainedMutex);
+        drainedMutex.unlock();
+
+        // A worker checks stopping under the mutex of its node before sleeping
+        stopping = true;
+        for (auto &node : nodes) {
+            node->sleepMutex.lock();
+            node->sleepCondition.notifyAll();
+            node->sleepMutex.unlock();
+        }
+
+        for (auto &w : workers) {
+            w->thread->join();
+            delete w->thread;
+            deleteJobs(w->freeJobs);
+        }
+        deleteJobs(freeJobs);
+    }
+
+    /* node is the preferred NUMA node of the runnable, -1 for the node of the caller */
+    bool start(std::unique_ptr<Runnable> runnable, int node = -1) {
+        return schedule(std::move(runnable), TaskHandle(), node);
+    }
+
+    TaskHandle submit(std::unique_ptr<Runnable> runnable, int node = -1) {
+        TaskHandle completion = statePool->acquire();
+        if (!schedule(std::move(runnable), completion, node)) completion.complete(TaskHandle::Status::Cancelled);
+        return completion;
+    }
+
+    size_t currentNbThreads() {
+        return workers.size();
+    }
+
+    size_t nbNodes() const {
+        return nodes.size();
+    }
+
+private:
+    struct Job {
+        std::unique_ptr<Runnable> runnable;
+        TaskHandle completion;
+        Job *nextFree = nullptr;
+    };
+
+    // Free jobs a worker keeps for itself before sharing them
+    static constexpr size_t LOCAL_FREE_JOBS = 64;
+
+    struct Worker {
+        PcoThread *thread = nullptr;
+        WorkStealingDeque<Job *> deque{};
+        uint64_t seed = 0;
+        size_t node = 0;
+        // Only used by the thread of the worker
+        Job *freeJobs = nullptr;
+        size_t nbFreeJobs = 0;
+    };
+
+    struct Node {
+        std::vector<int> cpus{};
+        std::vector<Worker *> workers{};
+
+        PcoMutex injectionMutex{};
+        std::deque<Job *> injected{};
+        std::atomic<size_t> nbInjected{0};
+
+        std::atomic<size_t> nbSleeping{0};
+        PcoMutex sleepMutex{};
+        PcoConditionVariable sleepCondition{};
+    };
+
+    /* Take a free job, from the list of the calling worker if any, else from the shared one */
+    Job *acquireJob(Worker *local, std::unique_ptr<Runnable> runnable, TaskHandle completion) {
+        Job *job = nullptr;
+        if (local && local->freeJobs) {
+            job = local->freeJobs;
+            local->freeJobs = job->nextFree;
+            --local->nbFreeJobs;
+        } else {
+            jobMutex.lock();
+            job = freeJobs;
+            if (job) freeJobs = job->nextFree;
+            jobMutex.unlock();
+        }
+
+        if (!job) job = new Job();
+        job->runnable = std::move(runnable);
+        job->completion = std::move(completion);
+        job->nextFree = nullptr;
+        return job;
+    }
+
+    /* Give a job run by the worker back, keeping it for the worker as long as it has few */
+    void recycleJob(Worker *self, Job *job) {
+        job->runnable.reset();
+        job->completion = TaskHandle();
+        if (self->nbFreeJobs < LOCAL_FREE_JOBS) {
+            job->nextFree = self->freeJobs;
+            self->freeJobs = job;
+            ++self->nbFreeJobs;
+            return;
+        }
+        jobMutex.lock();
+        job->nextFree = freeJobs;
+        freeJobs = job;
+        jobMutex.unlock();
+    }
+
+    static void deleteJobs(Job *jobs) {
+        while (jobs) {
+            Job *job = jobs;
+            jobs = job->nextFree;
+            delete job;
+        }
+    }
+
+    /* Node of a submission: the hinted one, else the one of the calling worker or CPU */
+    size_t targetNode(Worker *local, int hint) {
+        if (hint >= 0 && static_cast<size_t>(hint) < nodes.size()) return hint;
+        if (local) return local->node;
+        if (nodes.size() == 1) return 0;
+        int cpu = currentCpu();
+        for (size_t node = 0; node < nodes.size(); ++node) {
+            for (int nodeCpu : nodes[node]->cpus) {
+                if (nodeCpu == cpu) return node;
+            }
+        }
+        return 0;
+    }
+
+    bool schedule(std::unique_ptr<Runnable> runnable, TaskHandle completion, int hint) {
+        Worker *local = (currentPool == this) ? currentWorker : nullptr;
+        size_t target = targetNode(local, hint);
+
+        if (local && local->node == target) {
+            nbPending.fetch_add(1);
+            local->deque.push(acquireJob(local, std::move(runnable), std::move(completion)));
+        } else {
+            Node &node = *nodes[target];
+            node.injectionMutex.lock();
+            if (node.injected.size() >= maxNbWaiting) {
+                node.injectionMutex.unlock();
+                runnable->cancelRun();
+                return false;
+            }
+            nbPending.fetch_add(1);
+            node.injected.push_back(acquireJob(local, std::move(runnable), std::move(completion)));
+            node.nbInjected.store(node.injected.size(), std::memory_order_relaxed);
+            node.injectionMutex.unlock();
+        }
+
+        // Pairs with the fence in park(): either the sleeper sees the job, or we see the sleeper
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wakeOne(target);
+        return true;
+    }
+
+    /* Wake a sleeping worker, of the given node if possible */
+    void wakeOne(size_t preferred) {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            Node &node = *nodes[(preferred + i) % nodes.size()];
+            if (node.nbSleeping.load(std::memory_order_relaxed) > 0) {
+                node.sleepMutex.lock();
+                node.sleepCondition.notifyOne();
+                node.sleepMutex.unlock();
+                return;
+            }
+        }
+    }
+
+    Job *takeInjected(Node &node) {
+        if (node.nbInjected.load(std::memory_order_relaxed) == 0) return nullptr;
+        node.injectionMutex.lock();
+        Job *job = nullptr;
+        if (!node.injected.empty()) {
+            job = node.injected.front();
+            node.injected.pop_front();
+            node.nbInjected.store(node.injected.size(), std::memory_order_relaxed);
+        }
+        node.injectionMutex.unlock();
+        return job;
+    }
+
+    Job *stealFrom(Worker *self, const std::vector<Worker *> &victims) {
+        size_t n = victims.size();
+        if (n == 0) return nullptr;
+        // xorshift64 to select the first victim
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 7;
+        self->seed ^= self->seed << 17;
+        size_t first = self->seed % n;
+
+        Job *job = nullptr;
+        for (size_t i = 0; i < n; ++i) {
+            Worker *victim = victims[(first + i) % n];
+            if (victim != self && victim->deque.steal(job)) return job;
+        }
+        return nullptr;
+    }
+
+    Job *findJob(Worker *self) {
+        Job *job = nullptr;
+        if (self->deque.pop(job)) return job;
+
+        // Work of the node of the worker first
+        Node &home = *nodes[self->node];
+        if ((job = takeInjected(home))) return job;
+        if ((job = stealFrom(self, home.workers))) return job;
+
+        // Then, as a fallback, work of the other nodes
+        for (size_t i = 1; i < nodes.size(); ++i) {
+            Node &other = *nodes[(self->node + i) % nodes.size()];
+            if ((job = takeInjected(other))) return job;
+            if ((job = stealFrom(self, other.workers))) return job;
+        }
+        return nullptr;
+    }
+
+    bool hasVisibleWork() {
+        for (auto &node : nodes)
+            if (node->nbInjected.load(std::memory_order_relaxed) > 0) return true;
+        for (auto &w : workers)
+            if (!w->deque.empty()) return true;
+        return false;
+    }
+
+    /* Returns false if the pool is stopping */
+    bool park(Worker *self) {
+        Node &node = *nodes[self->node];
+        node.sleepMutex.lock();
+        node.nbSleeping.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!stopping && !hasVisibleWork()) node.sleepCondition.wait(&node.sleepMutex);
+        node.nbSleeping.fetch_sub(1, std::memory_order_relaxed);
+        bool running = !stopping;
+        node.sleepMutex.unlock();
+        return running;
+    }
+
+    void execute(Worker *self) {
+        currentPool = this;
+        currentWorker = self;
+        if (!nodes[self->node]->cpus.empty()) pinCurrentThread(nodes[self->node]->cpus);
+
+        while (true) {
+            Job *job = findJob(self);
+            if (!job) {
+                if (!park(self)) return;
+                continue;
+            }
+
+            // An exception fails the handle of the job instead of ending the thread
+            std::exception_ptr error;
+            try {
+                job->runnable->run();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            if (error) job->completion.fail(error);
+            else job->completion.complete(TaskHandle::Status::Done);
+            recycleJob(self, job);
+
+            // Signal destructor if required no task is left
+            if (nbPending.fetch_sub(1) == 1) {
+                drainedMutex.lock();
+                drainedCondition.notifyAll();
+                drainedMutex.unlock();
+            }
+        }
+    }
+
+    static inline thread_local WorkStealingPool *currentPool = nullptr;
+    static inline thread_local Worker *currentWorker = nullptr;
+
+    size_t maxNbWaiting;
+    std::vector<std::unique_ptr<Worker>> workers{};
+    std::vector<std::unique_ptr<Node>> nodes{};
+
+    std::atomic<size_t> nbPending{0};
+    PcoMutex drainedMutex{};
+    PcoConditionVariable drainedCondition{};
+    std::atomic<bool> stopping{false};
+
+    // Jobs given back by the workers beyond their own LOCAL_FREE_JOBS
+    PcoMutex jobMutex{};
+    Job *freeJobs = nullptr;
+    std::shared_ptr<TaskStatePool> statePool = std::make_shared<TaskStatePool>();
+};
+
+#endif // WORKSTEALINGPOOL_H